@@ -1,31 +1,67 @@
 // Bouncy ball reflections demo.
 //
 // It's not a very big program so the whole thing is written around
-// this Ball class that does everything -- unsophisticated bouncy
-// physics and OpenGL draw calls all come from there. A properly
+// this Ball class that does everything -- the OpenGL draw calls all
+// come from there. The unsophisticated bouncy physics lives in
+// BallPhysics, which stores every ball's state in flat arrays; it's in
+// physics.hh, free of OpenGL, so that physics_bench.cc can time it on
+// its own. A BallList holds those arrays plus the balls' colors, and a
+// Ball is just a handle to one entry of a BallList. The scene comes
+// from random spawning or a scene file (see SceneHeader). A properly
 // structured program, which this is not, would have some abstraction
 // layer for OpenGL but we don't do that.
 //
-// Basically, what we do is keep an OpenGL cubemap texture handle and
-// 6 framebuffer handles in each Ball object. Each frame, we draw the
-// scene to the screen as usual, but we also draw the scene onto each
+// Basically, what we do is give each Ball a cubemap (a slot in a
+// shared array of cubemap faces, the probe array). Each frame, we draw
+// the scene to the screen as usual, but we also draw the scene onto each
 // ball's cubemap texture (from each ball's perspective). When we draw
 // a Ball, we calculate a reflection vector for each fragment and
 // sample from the Ball's cubemap to create reflection effects.
 //
-// This code is not even close to threadsafe.
+// By default the six cubemap faces are drawn in one pass: a layered
+// framebuffer with a scratch cubemap attached, plus a geometry shader
+// that copies every triangle onto all six faces, after which the faces
+// are copied into the cubemap of the ball being updated. Press G to
+// switch back to drawing the faces one at a time. The faces of all
+// balls' cubemaps are stored in one array texture so that all balls
+// can be drawn with one instanced draw call per shader program and
+// sphere level of detail.
+//
+// This code is not even close to threadsafe. The exception is the
+// physics, which runs on its own Simulation thread (publishing
+// snapshots of the balls for the render thread to draw) and can split
+// its work over a JobPool of threads.
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <string>
+#include <thread>
 #include <vector>
-#include <list>
+#include <algorithm>
 #include <utility>
 using std::swap;
 
@@ -37,23 +73,20 @@ using std::swap;
 #include "SDL2/SDL.h"
 #include "SDL2/SDL_opengl.h"
 
+#include "physics.hh"
+
 namespace {
 
 constexpr float
-    ball_radius = 0.1f,
     ball_core_radius_ratio = 0.707f,
-    min_x = -0.8f,
-    max_x = +0.8f,
-    min_y = 0.0f,
-    max_y = 2.0f,
-    min_z = -0.8f,
-    max_z = +0.8f,
-    gravity = 0.0f,
     fovy_radians = 1.0f,
     near_plane = 0.01f,
     far_plane = 20.0f,
     camera_speed = 8e-2,
-    base_tick_dt = 0.001f;
+    base_tick_dt = 0.001f,
+    probe_own_min_pixels = 24.0f,
+    probe_share_distance = 0.5f,
+    probe_memory_budget_mb = 1024.0f;
 
 constexpr int
     plus_x_index = 0,
@@ -62,9 +95,10 @@ constexpr int
     minus_y_index = 3,
     plus_z_index = 4,
     minus_z_index = 5,
-    ball_cubemap_dim = 512,
-    ball_count = 18,
-    ticks_per_frame = 20;
+    sim_period_ms = 16,
+    scene_probe_interval = 4,
+    benchmark_warmup_frames = 10,
+    orbit_camera_frames = 600;
 
 GLenum cubemap_face_enums[] = {
     GL_TEXTURE_CUBE_MAP_POSITIVE_X,
@@ -75,9 +109,76 @@ GLenum cubemap_face_enums[] = {
     GL_TEXTURE_CUBE_MAP_NEGATIVE_Z,
 };
 
+// Camera forward and up vectors for rendering each cubemap face (same
+// order as cubemap_face_enums). These match the orientation OpenGL
+// uses when sampling cubemaps.
+const glm::vec3 cubemap_face_forward[] = {
+    glm::vec3(1,0,0), glm::vec3(-1,0,0),
+    glm::vec3(0,1,0), glm::vec3(0,-1,0),
+    glm::vec3(0,0,1), glm::vec3(0,0,-1),
+};
+const glm::vec3 cubemap_face_up[] = {
+    glm::vec3(0,-1,0), glm::vec3(0,-1,0),
+    glm::vec3(0,0,1), glm::vec3(0,0,-1),
+    glm::vec3(0,-1,0), glm::vec3(0,-1,0),
+};
+
+// Sphere mesh levels of detail, from finest to coarsest: the number of
+// grid cells along each edge of the six cube faces that are projected
+// onto the sphere, and the smallest projected radius (in pixels) a
+// ball needs to be drawn at that level.
+constexpr int sphere_lod_count = 4;
+const int sphere_lod_divisions[sphere_lod_count] = { 10, 6, 4, 2 };
+const float sphere_lod_min_pixels[sphere_lod_count] = { 40, 16, 6, 0 };
+
 int screen_x = 1280, screen_y = 960;
-bool paused = false, do_one_tick = false;
-float tick_dt = 0.005f;
+int viewport_height = 960; // Of the current framebuffer; see set_viewport.
+// Reflection probe face size and color format; see --probe-dim and
+// --probe-format.
+int probe_dim = 512;
+GLenum probe_format = GL_RGB8;
+bool gpu_physics = false; // See --physics.
+bool profiling = false; // See Profiler.
+// Set from the command line before the physics starts; see --ball-count
+// and --seed (-1 picks a seed from the time, or 1 when benchmarking or
+// capturing). The physics settings (the box, gravity and
+// ticks_per_frame) are in physics.hh.
+int ball_count = 18;
+int64_t random_seed = -1;
+float spawn_min_radius = 0.1f, spawn_max_radius = 0.1f; // See --ball-radius.
+// See --scene and --write-scene; F5 and F9 save and restore
+// quick_save_path.
+std::string scene_path, write_scene_path;
+std::string quick_save_path = "bouncy_scene.bsc";
+bool save_scene_pending = false, restore_scene_pending = false;
+// See --record, --replay and --replay-start.
+std::string record_path, replay_path;
+int replay_start = 0;
+// See --benchmark and --benchmark-output; 0 frames runs interactively.
+int benchmark_frames = 0;
+std::string benchmark_output;
+GLenum write_skybox_format = 0; // See --write-skybox.
+// Environment directories, ending in slashes, that N cycles through;
+// see --skybox. Main adds the texture directory if there are none.
+std::vector<std::string> skybox_directories;
+// See --capture, --capture-size and --capture-frames; no capture_path
+// runs interactively.
+std::string capture_path;
+int capture_width = 1920, capture_height = 1080, capture_frames = 600;
+bool layered_probes = true, interpolate_snapshots = true;
+bool stagger_probe_faces = false, impostor_balls = false;
+bool reflection_lod = true, occlusion_culling = false;
+int probes_per_frame = 0;
+float probe_budget_ms = 0.0f;
+int reflection_bounces = 2; // See ProbeScheduler and --reflection-bounces.
+int skybox_generation = 0; // Counts skybox texture changes.
+// See ResolutionScaler and --target-fps.
+bool adaptive_resolution = false;
+float target_frame_ms = 1000.0f / 60;
+// Read by the Simulation thread.
+std::atomic<bool> paused { false }, do_one_tick { false };
+std::atomic<float> tick_dt { 0.005f };
+std::atomic<Integrator> integrator { Integrator::euler_substeps };
 SDL_Window* window = nullptr;
 std::string argv0;
 
@@ -100,294 +201,2927 @@ static void panic(const char* message, const char* reason) {
     } \
 } while (0)
 
-static GLuint make_program(const char* vs_code, const char* fs_code) {
-    static GLchar log[1024];
-    PANIC_IF_GL_ERROR;
-    GLuint program_id = glCreateProgram();
-    GLuint vs_id = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fs_id = glCreateShader(GL_FRAGMENT_SHADER);
+// glGetError makes many drivers wait for the GPU, so the per-frame draw
+// paths only check for errors in checked builds (make checked, which
+// defines BOUNCY_CHECKED_GL). Other builds rely on the KHR_debug
+// callback installed by install_gl_debug_callback to report errors, if
+// the driver supports it. Setup code, which only runs once, always uses
+// PANIC_IF_GL_ERROR.
+#ifdef BOUNCY_CHECKED_GL
+#define DRAW_PANIC_IF_GL_ERROR PANIC_IF_GL_ERROR
+#else
+#define DRAW_PANIC_IF_GL_ERROR do { } while (0)
+#endif
+
+// KHR_debug isn't part of OpenGL 3.3, so gl_core_3_3.h doesn't have it.
+namespace khr_debug {
+    constexpr GLenum
+        debug_output = 0x92E0,
+        debug_output_synchronous = 0x8242,
+        debug_type_error = 0x824C,
+        debug_severity_notification = 0x826B;
     
-    const GLchar* string_array[1];
-    string_array[0] = (GLchar*)vs_code;
-    glShaderSource(vs_id, 1, string_array, nullptr);
-    string_array[0] = (GLchar*)fs_code;
-    glShaderSource(fs_id, 1, string_array, nullptr);
+    typedef void (APIENTRY* DebugProc)(
+        GLenum source, GLenum type, GLuint id, GLenum severity,
+        GLsizei length, const GLchar* message, const void* user);
+    typedef void (APIENTRY* DebugMessageCallbackProc)(
+        DebugProc callback, const void* user);
+}
+
+// ARB_get_program_binary (core only from OpenGL 4.1) and the
+// compressed texture formats of the skybox container aren't in
+// gl_core_3_3.h either.
+namespace program_binary {
+    constexpr GLenum
+        retrievable_hint = 0x8257,
+        binary_length = 0x8741,
+        num_binary_formats = 0x87FE;
     
-    glCompileShader(vs_id);
-    glCompileShader(fs_id);
+    typedef void (APIENTRY* GetProgramBinaryProc)(
+        GLuint program, GLsizei buffer_size, GLsizei* length,
+        GLenum* format, void* binary);
+    typedef void (APIENTRY* ProgramBinaryProc)(
+        GLuint program, GLenum format, const void* binary, GLsizei length);
+    typedef void (APIENTRY* ProgramParameteriProc)(
+        GLuint program, GLenum name, GLint value);
+}
+
+namespace buffer_storage {
+    constexpr GLbitfield
+        map_persistent_bit = 0x0040,
+        map_coherent_bit = 0x0080;
     
-    PANIC_IF_GL_ERROR;
+    typedef void (APIENTRY* BufferStorageProc)(
+        GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+}
+
+namespace texture_compression {
+    constexpr GLenum
+        rgb_s3tc_dxt1 = 0x83F0,             // BC1
+        rgb_bptc_unsigned_float = 0x8E8F,   // BC6H
+        rgb8_etc2 = 0x9274;                 // ETC2
+}
+
+static void APIENTRY gl_debug_callback(
+    GLenum, GLenum type, GLuint id, GLenum severity,
+    GLsizei, const GLchar* message, const void*
+) {
+    if (severity == khr_debug::debug_severity_notification) return;
+    fprintf(stderr, "%s: OpenGL %s %u: %s\n", argv0.c_str(),
+            type == khr_debug::debug_type_error ? "error" : "message",
+            id, message);
+#ifdef BOUNCY_CHECKED_GL
+    if (type == khr_debug::debug_type_error) panic("OpenGL error", message);
+#endif
+}
+
+// Have the driver report OpenGL errors and warnings through
+// gl_debug_callback, if it supports KHR_debug (or ARB_debug_output,
+// which has the same entry point with a different suffix). In checked
+// builds the reports are synchronous so that they come from the call
+// that caused them. Returns false if neither extension is available.
+static bool install_gl_debug_callback() {
+    const char* names[][2] = {
+        { "GL_KHR_debug", "glDebugMessageCallback" },
+        { "GL_KHR_debug", "glDebugMessageCallbackKHR" },
+        { "GL_ARB_debug_output", "glDebugMessageCallbackARB" },
+    };
+    for (auto const& name : names) {
+        if (!SDL_GL_ExtensionSupported(name[0])) continue;
+        auto callback_setter = reinterpret_cast<khr_debug::DebugMessageCallbackProc>(
+            SDL_GL_GetProcAddress(name[1]));
+        if (callback_setter == nullptr) continue;
+        
+        callback_setter(gl_debug_callback, nullptr);
+        glEnable(khr_debug::debug_output);
+#ifdef BOUNCY_CHECKED_GL
+        glEnable(khr_debug::debug_output_synchronous);
+#endif
+        // ARB_debug_output has no debug_output switch, so the glEnable
+        // is an invalid enum there; don't let it trip a later check.
+        glGetError();
+        return true;
+    }
+    return false;
+}
+
+// Lock-free triple buffer for handing the newest T from one writer
+// thread to one reader thread without either waiting for the other.
+// The writer fills write_buffer() and calls publish(); the reader
+// calls update() and then reads read_buffer(), which is the newest T
+// published. Each side only ever touches its own buffer, and they
+// trade buffers through the middle one with atomic exchanges.
+template <typename T>
+class TripleBuffer {
+    static constexpr int index_mask = 3, fresh_bit = 4;
+    T buffers[3];
+    // Index of the middle buffer, plus fresh_bit if the writer
+    // published it since the reader last took it.
+    std::atomic<int> middle { 1 };
+    int back = 0, front = 2;
     
-    GLint okay = 0;
-    GLsizei length = 0;
-    const GLuint shader_id_array[2] = { vs_id, fs_id };
-    for (auto id : shader_id_array) {
-        glGetShaderiv(id, GL_COMPILE_STATUS, &okay);
-        if (okay) {
-            glAttachShader(program_id, id);
-        } else {
-            glGetShaderInfoLog(id, sizeof log, &length, log);
-            fprintf(stderr, "%s\n", id == vs_id ? vs_code : fs_code);
-            panic("Shader compilation error", log);
-        }
+  public:
+    T& write_buffer() {
+        return buffers[back];
     }
     
-    glLinkProgram(program_id);
-    glGetProgramiv(program_id, GL_LINK_STATUS, &okay);
-    if (!okay) {
-        glGetProgramInfoLog(program_id, sizeof log, &length, log);
-        panic("Shader link error", log);
+    void publish() {
+        back = middle.exchange(back | fresh_bit, std::memory_order_acq_rel)
+             & index_mask;
     }
     
-    PANIC_IF_GL_ERROR;
-    return program_id;
-}
+    // Returns true if read_buffer() now holds a newer T.
+    bool update() {
+        if (!(middle.load(std::memory_order_relaxed) & fresh_bit)) return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & index_mask;
+        return true;
+    }
+    
+    T const& read_buffer() const {
+        return buffers[front];
+    }
+};
 
-// To do reflections on each ball, we will associate a framebuffer
-// object and six 2d texture faces (+/- xyz) to each ball in the
-// scene. We will render a "skybox" from the perspective of each ball
-// and sample reflections from this skybox.
-struct BallRender {
-    GLuint framebuffers[6];
-    GLuint cubemap;
+// Recording files (--record, played back by Replay) hold the state of
+// every ball after every physics step: a RecordingHeader, the starting
+// scene (the contents of a scene file; see SceneHeader), then one
+// record per step. A record is a uint32 byte count and that many bytes
+// of varints: the x of every ball, then y, z, vx, vy and vz, quantized
+// to position_quantum and velocity_quantum and stored as the change
+// from the previous record. Every keyframe_interval-th record (from
+// the first) is a keyframe, stored as the change from zero, so that a
+// replay can start anywhere without decoding everything before it.
+struct RecordingHeader {
+    char magic[4]; // recording_magic
+    uint32_t ball_count;
+    float position_quantum, velocity_quantum;
+    uint32_t keyframe_interval;
+    uint32_t unused;
 };
 
-class Ball;
-using BallList = std::list<Ball>;
+const char recording_magic[4] = { 'B', 'R', 'C', '1' };
 
-static void draw_skybox(
-    glm::mat4 view_matrix, glm::mat4 proj_matrix
-);
+// Append value to *out in as few bytes as its magnitude needs: zigzag
+// encoded (so small negative numbers are small too), 7 bits per byte,
+// with the top bit set on all bytes but the last.
+static void put_varint(int32_t value, std::vector<uint8_t>* out) {
+    uint32_t bits = (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+    while (bits >= 0x80) {
+        out->push_back(uint8_t(bits | 0x80));
+        bits >>= 7;
+    }
+    out->push_back(uint8_t(bits));
+}
 
-static void draw_scene(
-    glm::mat4 view_matrix, glm::mat4 proj_matrix,
-    BallList const& list, Ball const* skip=nullptr
-);
+// Read a put_varint value from *p (which must be before end) into
+// *value and move *p past it. Returns false if it runs off the end.
+static bool get_varint(uint8_t const** p, uint8_t const* end, int32_t* value) {
+    uint32_t bits = 0;
+    for (int shift = 0; shift < 35 && *p != end; shift += 7) {
+        uint8_t byte = *(*p)++;
+        bits |= uint32_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = int32_t(bits >> 1) ^ -int32_t(bits & 1);
+            return true;
+        }
+    }
+    return false;
+}
 
-class Ball {
-    glm::vec3 position;
-    glm::vec3 velocity;
-    float r, g, b, radius;
-    bool bounced = false;
-    BallRender render;
-    
-    static std::vector<BallRender> recycled_ball_render;
+// Streams the balls' states to a recording file. record() just copies
+// the state into a queue; a writer thread quantizes and encodes the
+// queued states and writes them out, so the physics only waits if the
+// writer falls max_queued_states behind.
+class Recorder {
   public:
-    Ball(glm::vec3 pos_arg, glm::vec3 vel_arg,
-         float r_arg, float g_arg, float b_arg, float radius_arg)
-    {
-        position = pos_arg;
-        velocity = vel_arg;
-        r = r_arg;
-        g = g_arg;
-        b = b_arg;
-        bounced = false;
-        radius = radius_arg;
-        
-        if (!recycled_ball_render.empty()) {
-            render = recycled_ball_render.back();
-            recycled_ball_render.pop_back();
+    static constexpr int keyframe_interval = 300;
+    static constexpr float position_quantum = 1.0f / 65536;
+    static constexpr float velocity_quantum = 1.0f / 65536;
+    
+    // Start recording ball_count balls starting from scene (the
+    // contents of a scene file) into a new file at path.
+    Recorder(std::string const& path_arg, int ball_count_arg,
+             std::vector<uint8_t> const& scene)
+        : path(path_arg), ball_count(ball_count_arg) {
+        file = fopen(path.c_str(), "wb");
+        if (file == nullptr) panic("Could not open recording", path.c_str());
+        RecordingHeader header = {};
+        memcpy(header.magic, recording_magic, 4);
+        header.ball_count = uint32_t(ball_count);
+        header.position_quantum = position_quantum;
+        header.velocity_quantum = velocity_quantum;
+        header.keyframe_interval = keyframe_interval;
+        okay = fwrite(&header, sizeof header, 1, file) == 1
+            && fwrite(scene.data(), 1, scene.size(), file) == scene.size();
+        thread = std::thread(&Recorder::run, this);
+    }
+    
+    // Write out everything still queued and close the file.
+    ~Recorder() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        queued.notify_one();
+        thread.join();
+        if (fclose(file) != 0) okay = false;
+        if (okay) {
+            printf("Recorded %lld steps to %s\n", (long long)record_count,
+                   path.c_str());
         } else {
-            PANIC_IF_GL_ERROR;
-            GLuint depth_buffers[6];
-            glGenFramebuffers(6, render.framebuffers);
-            glGenRenderbuffers(6, depth_buffers);
-            glGenTextures(1, &render.cubemap);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, render.cubemap);
+            fprintf(stderr, "%s: Could not write recording %s\n",
+                    argv0.c_str(), path.c_str());
+        }
+    }
+    
+    Recorder(Recorder const&) = delete;
+    Recorder& operator=(Recorder const&) = delete;
+    
+    // Queue the state after a step. Calls must come from one thread at
+    // a time, in step order.
+    void record(BallPhysics const& state) {
+        assert(state.size() == ball_count);
+        State copy;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            written.wait(lock, [this] {
+                return int(queue.size()) < max_queued_states;
+            });
+            if (!spare_states.empty()) {
+                copy = std::move(spare_states.back());
+                spare_states.pop_back();
+            }
+        }
+        copy.values[0] = state.x;
+        copy.values[1] = state.y;
+        copy.values[2] = state.z;
+        copy.values[3] = state.vx;
+        copy.values[4] = state.vy;
+        copy.values[5] = state.vz;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(copy));
+        }
+        queued.notify_one();
+    }
+    
+  private:
+    static constexpr int max_queued_states = 64;
+    
+    struct State {
+        std::vector<float> values[6]; // x, y, z, vx, vy, vz.
+    };
+    
+    std::string path;
+    int ball_count;
+    FILE* file = nullptr;
+    bool okay = false; // Only touched by the writer thread once it runs.
+    int64_t record_count = 0;
+    
+    std::mutex mutex;
+    std::condition_variable queued, written;
+    std::deque<State> queue;
+    std::vector<State> spare_states; // Reused to save allocations.
+    bool quit = false;
+    std::thread thread;
+    
+    static int32_t quantize(float value, float quantum) {
+        float q = std::min(1073741823.0f, std::max(-1073741823.0f,
+                                                    value / quantum));
+        return int32_t(lrintf(q));
+    }
+    
+    void run() {
+        std::vector<int32_t> previous(6 * ball_count, 0);
+        std::vector<uint8_t> bytes;
+        for (;;) {
+            State state;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [this] { return quit || !queue.empty(); });
+                if (queue.empty()) return;
+                state = std::move(queue.front());
+                queue.pop_front();
+            }
+            written.notify_one();
             
-            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);   
+            bool keyframe = record_count % keyframe_interval == 0;
+            bytes.assign(4, 0);
+            for (int field = 0; field < 6; ++field) {
+                float quantum = field < 3 ? position_quantum : velocity_quantum;
+                int32_t* last = &previous[field * ball_count];
+                for (int i = 0; i < ball_count; ++i) {
+                    int32_t q = quantize(state.values[field][i], quantum);
+                    put_varint(keyframe ? q : q - last[i], &bytes);
+                    last[i] = q;
+                }
+            }
+            uint32_t size = uint32_t(bytes.size() - 4);
+            memcpy(bytes.data(), &size, 4);
+            okay = okay && fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+            ++record_count;
             
-            PANIC_IF_GL_ERROR;
+            std::lock_guard<std::mutex> lock(mutex);
+            spare_states.push_back(std::move(state));
+        }
+    }
+};
+
+constexpr float Recorder::position_quantum, Recorder::velocity_quantum;
+
+// Runs the physics on its own thread, stepping it every sim_period_ms
+// no matter how long the render thread takes to draw a frame. After
+// each step the thread publishes a Snapshot of the balls through a
+// TripleBuffer, and the render thread copies the newest one into its
+// own BallPhysics with read_positions. Ball colors never change so
+// they stay in the BallList.
+//
+// The thread reads the paused, do_one_tick, tick_dt and integrator
+// globals, which is why those are atomic. With a recorder, it also
+// records the state after every step.
+class Simulation {
+  public:
+    struct Snapshot {
+        double time = 0.0; // Seconds on steady_clock.
+        std::vector<float> x, y, z, radius;
+    };
+    
+    explicit Simulation(BallPhysics const& initial, Recorder* recorder_arg=nullptr)
+        : physics(initial), recorder(recorder_arg) {
+        publish(clock::now());
+        snapshots.update();
+        current = previous = snapshots.read_buffer();
+        thread = std::thread(&Simulation::run, this);
+    }
+    
+    ~Simulation() {
+        quit = true;
+        thread.join();
+    }
+    
+    Simulation(Simulation const&) = delete;
+    Simulation& operator=(Simulation const&) = delete;
+    
+    // Copy the positions and radii of the balls from the newest
+    // snapshot to *out, which must have the same number of balls. With
+    // interpolate, the positions are instead blended between the two
+    // newest snapshots at one sim period ago: that costs a tick of
+    // latency but keeps the motion smooth when the frame rate doesn't
+    // match the tick rate.
+    void read_positions(BallPhysics* out, bool interpolate) {
+        if (snapshots.update()) {
+            swap(previous, current);
+            current = snapshots.read_buffer();
+        }
+        assert(out->size() == int(current.x.size()));
+        
+        out->radius = current.radius;
+        double span = current.time - previous.time;
+        if (!interpolate || span <= 0.0) {
+            out->x = current.x;
+            out->y = current.y;
+            out->z = current.z;
+            return;
+        }
+        
+        double render_time = seconds(clock::now()) - sim_period_ms * 1e-3;
+        float t = float(std::min(1.0, std::max(0.0,
+            (render_time - previous.time) / span)));
+        for (int i = 0; i < out->size(); ++i) {
+            out->x[i] = previous.x[i] + t * (current.x[i] - previous.x[i]);
+            out->y[i] = previous.y[i] + t * (current.y[i] - previous.y[i]);
+            out->z[i] = previous.z[i] + t * (current.z[i] - previous.z[i]);
+        }
+    }
+    
+    // Copy the whole state of the balls, velocities included, between
+    // two steps. Blocks the simulation thread while copying; for saving
+    // the scene, not for every frame.
+    void copy_state(BallPhysics* out) {
+        std::lock_guard<std::mutex> lock(physics_mutex);
+        *out = physics;
+    }
+    
+  private:
+    typedef std::chrono::steady_clock clock;
+    
+    BallPhysics physics;
+    Recorder* recorder;
+    std::mutex physics_mutex; // Held by the thread while stepping.
+    TripleBuffer<Snapshot> snapshots;
+    std::atomic<bool> quit { false };
+    std::thread thread;
+    
+    // Owned by the render thread.
+    Snapshot previous, current;
+    
+    static double seconds(clock::time_point time) {
+        return std::chrono::duration<double>(time.time_since_epoch()).count();
+    }
+    
+    void publish(clock::time_point time) {
+        Snapshot& snapshot = snapshots.write_buffer();
+        snapshot.time = seconds(time);
+        snapshot.x = physics.x;
+        snapshot.y = physics.y;
+        snapshot.z = physics.z;
+        snapshot.radius = physics.radius;
+        snapshots.publish();
+    }
+    
+    void run() {
+        auto period = std::chrono::milliseconds(sim_period_ms);
+        auto tick_time = clock::now();
+        while (!quit) {
+            tick_time += period;
+            std::this_thread::sleep_until(tick_time);
+            auto now = clock::now();
+            if (now - tick_time > std::chrono::milliseconds(100)) {
+                tick_time = now;
+            }
             
-            for (int i = 0; i < 6; ++i) {
-                glBindFramebuffer(GL_FRAMEBUFFER, render.framebuffers[i]);
-                
-                PANIC_IF_GL_ERROR;
-                
-                auto face = cubemap_face_enums[i];
-                
-                PANIC_IF_GL_ERROR;
-                glTexImage2D(
-                    face, 0, GL_RGB, ball_cubemap_dim, ball_cubemap_dim, 0,
-                    GL_RGB, GL_UNSIGNED_BYTE, 0
-                );
-                
-                PANIC_IF_GL_ERROR;
-                
-                glBindRenderbuffer(GL_RENDERBUFFER, depth_buffers[i]);
-                
-                PANIC_IF_GL_ERROR;
-                glRenderbufferStorage(
-                    GL_RENDERBUFFER, GL_DEPTH_COMPONENT,
-                    ball_cubemap_dim, ball_cubemap_dim
-                );
-                PANIC_IF_GL_ERROR;
-                glFramebufferRenderbuffer(
-                    GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-                    GL_RENDERBUFFER, depth_buffers[i]
-                );
-                PANIC_IF_GL_ERROR;
-                glFramebufferTexture2D(
-                    GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                    cubemap_face_enums[i], render.cubemap, 0
-                );
-                GLenum tmp = GL_COLOR_ATTACHMENT0;
-                glDrawBuffers(1, &tmp);
-                PANIC_IF_GL_ERROR;
-                
-/*                if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-                    printf("%i\n", (int)glCheckFramebufferStatus(GL_FRAMEBUFFER));
-                    panic("Apocalypse", "Framebuffer Frobnication Error");
-                }*/
+            bool one_tick = do_one_tick.exchange(false);
+            if (!paused || one_tick) {
+                std::lock_guard<std::mutex> lock(physics_mutex);
+                physics.step(tick_dt, integrator);
+                if (recorder) recorder->record(physics);
+                publish(tick_time);
             }
         }
     }
+};
+
+// Low overhead CPU and GPU profiler for the stages of a frame. A
+// ProfileScope marks a stage, and records its CPU time and its GPU
+// time from a pair of GL_TIMESTAMP queries. Stages nest; that's why
+// this uses timestamps and not GL_TIME_ELAPSED queries, which can't
+// nest (and ProbeScheduler already has one running around the probe
+// updates). The queries of each frame go in a ring of latency frames,
+// and a frame's results are only read when its slot comes round
+// again, so profiling never waits for the GPU. If they still aren't
+// available then, that frame's GPU times are dropped instead.
+//
+// The last history_frames frames are kept for the overlay, the
+// summary and the trace. With profiling off (the default), scopes
+// cost a branch.
+class Profiler {
+  public:
+    // Call at the start of every frame.
+    void begin_frame() {
+        Frame& frame = frames[frame_number % latency];
+        collect(&frame);
+        frame.events.clear();
+        frame.queries_used = 0;
+        ++frame_number;
+        depth = 0;
+        
+        if (profiling && !clocks_synced) {
+            GLint64 gpu_ns = 0;
+            glGetInteger64v(GL_TIMESTAMP, &gpu_ns);
+            gpu_offset_us = now_us() - gpu_ns * 1e-3;
+            clocks_synced = true;
+        }
+    }
     
-    ~Ball() {
-        recycled_ball_render.push_back(render);
+    // Start a stage called name (a string literal), returning the
+    // argument for the matching end, or -1 if not profiling.
+    int begin(const char* name) {
+        if (!profiling) return -1;
+        Frame& frame = current_frame();
+        Event event;
+        event.name = name;
+        event.depth = depth++;
+        event.query_begin = next_query(&frame);
+        glQueryCounter(event.query_begin, GL_TIMESTAMP);
+        event.cpu_begin_us = event.cpu_end_us = now_us();
+        frame.events.push_back(event);
+        return int(frame.events.size()) - 1;
     }
     
-    Ball(Ball&&) = delete;
+    void end(int index) {
+        Frame& frame = current_frame();
+        if (index < 0 || index >= int(frame.events.size())) return;
+        Event& event = frame.events[index];
+        event.query_end = next_query(&frame);
+        glQueryCounter(event.query_end, GL_TIMESTAMP);
+        event.cpu_end_us = now_us();
+        --depth;
+    }
     
-    // Returns true (and modifies velocity) if we bounce with the
-    // other ball.  The other ball is also affected. We bounce if the
-    // two balls overlap and the two balls are moving towards each
-    // other (so don't bounce if they're already moving away; that
-    // would put them back on a collision course).
-    //
-    // Sets the bounce flag of both balls to true if we bounced.
-    bool bounce_ball(Ball* other_ball_ptr) {
-        // This isn't right physics.
-        Ball& other = *other_ball_ptr;
-        glm::vec3 displacement = other.position - position;
-        float squared_distance = dot(displacement, displacement);
-        float squared_radii = (radius + other.radius)
-                            * (radius + other.radius);
-        
-        bool collision_course = dot(displacement, velocity-other.velocity) > 0;
-        
-        if (collision_course && squared_distance < squared_radii) {
-            swap(velocity, other.velocity);
-            bounced = true;
-            other.bounced = true;
-            return true;
+    // Draw the newest complete frame's stages as bars in the bottom
+    // left corner of the current framebuffer: one row per stage name
+    // (indented by nesting depth, in order of first appearance), with
+    // the stage's total GPU time per frame as a thick bar and its CPU
+    // time as a thin white bar under it. The dark panel behind them is
+    // 1/60 s wide, with ticks every millisecond. print_summary names
+    // the rows.
+    void draw_overlay() const {
+        if (history.empty()) return;
+        std::vector<StageTotal> totals = stage_totals(history.back());
+        
+        GLfloat clear_color[4];
+        glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+        glEnable(GL_SCISSOR_TEST);
+        auto rect = [] (float x, float y, float w, float h, glm::vec3 color) {
+            if (w < 1.0f) w = 1.0f;
+            glScissor(GLint(x), GLint(y), GLsizei(w), GLsizei(h));
+            glClearColor(color[0], color[1], color[2], 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+        };
+        
+        const float x0 = 8, y0 = 8, row_height = 10, ms_width = 20;
+        const float panel_height = row_height * totals.size() + 4;
+        rect(x0 - 2, y0 - 2, ms_width * 1000.0f / 60 + 4, panel_height,
+             glm::vec3(0.1f));
+        for (int ms = 1; ms <= 16; ++ms) {
+            rect(x0 + ms * ms_width, y0 - 2, 1, panel_height, glm::vec3(0.3f));
+        }
+        for (size_t i = 0; i < totals.size(); ++i) {
+            StageTotal const& total = totals[i];
+            float x = x0 + 6 * total.depth;
+            float y = y0 + row_height * (totals.size() - 1 - i);
+            if (total.gpu_ms >= 0) {
+                rect(x, y + 3, total.gpu_ms * ms_width, row_height - 4,
+                     palette[i % palette_size]);
+            }
+            rect(x, y + 1, total.cpu_ms * ms_width, 1, glm::vec3(1.0f));
+        }
+        
+        glDisable(GL_SCISSOR_TEST);
+        glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+    }
+    
+    // Print each stage's mean CPU and GPU time per frame over the
+    // history, in overlay row order.
+    void print_summary() const {
+        if (history.empty()) return;
+        std::vector<StageTotal> sums;
+        std::vector<int> gpu_frames;
+        for (auto const& events : history) {
+            for (StageTotal const& total : stage_totals(events)) {
+                auto it = std::find_if(sums.begin(), sums.end(),
+                    [&total] (StageTotal const& sum) {
+                        return strcmp(sum.name, total.name) == 0;
+                    });
+                if (it == sums.end()) {
+                    sums.push_back(total);
+                    sums.back().cpu_ms = sums.back().gpu_ms = 0;
+                    gpu_frames.push_back(0);
+                    it = sums.end() - 1;
+                }
+                it->cpu_ms += total.cpu_ms;
+                if (total.gpu_ms >= 0) {
+                    it->gpu_ms += total.gpu_ms;
+                    ++gpu_frames[it - sums.begin()];
+                }
+            }
+        }
+        
+        printf("%-24s %8s %8s\n", "stage", "cpu ms", "gpu ms");
+        for (size_t i = 0; i < sums.size(); ++i) {
+            printf("%*s%-*s %8.3f %8.3f\n", 2 * sums[i].depth, "",
+                   24 - 2 * sums[i].depth, sums[i].name,
+                   sums[i].cpu_ms / history.size(),
+                   gpu_frames[i] ? sums[i].gpu_ms / gpu_frames[i] : 0.0);
+        }
+    }
+    
+    // Write the history as a Chrome trace (chrome://tracing or
+    // Perfetto), with the CPU and GPU times as two threads. Returns
+    // false if the file couldn't be written.
+    bool write_trace(const char* path) const {
+        FILE* file = fopen(path, "w");
+        if (file == nullptr) return false;
+        fprintf(file, "{\"traceEvents\":[\n"
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+            "\"args\":{\"name\":\"CPU\"}},\n"
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,"
+            "\"args\":{\"name\":\"GPU\"}}");
+        auto write_event = [file] (const char* name, int tid, double begin, double end) {
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}", name, tid, begin, end - begin);
+        };
+        for (auto const& events : history) {
+            for (Event const& event : events) {
+                write_event(event.name, 1, event.cpu_begin_us, event.cpu_end_us);
+                if (event.gpu_begin_us >= 0) {
+                    write_event(event.name, 2, event.gpu_begin_us, event.gpu_end_us);
+                }
+            }
+        }
+        fprintf(file, "\n]}\n");
+        return fclose(file) == 0;
+    }
+    
+  private:
+    static constexpr int latency = 4, history_frames = 120, palette_size = 6;
+    const glm::vec3 palette[palette_size] = {
+        { 0.9f, 0.3f, 0.3f }, { 0.3f, 0.8f, 0.3f }, { 0.3f, 0.5f, 1.0f },
+        { 0.9f, 0.8f, 0.2f }, { 0.8f, 0.3f, 0.9f }, { 0.2f, 0.8f, 0.8f },
+    };
+    typedef std::chrono::steady_clock clock;
+    
+    struct Event {
+        const char* name;
+        int depth;
+        GLuint query_begin = 0, query_end = 0;
+        double cpu_begin_us, cpu_end_us;
+        double gpu_begin_us = -1, gpu_end_us = -1; // -1 if not known.
+    };
+    
+    struct Frame {
+        std::vector<Event> events;
+        std::vector<GLuint> queries;
+        int queries_used = 0;
+    };
+    
+    // Total times per frame of the stages with one name.
+    struct StageTotal {
+        const char* name;
+        int depth;
+        double cpu_ms, gpu_ms; // gpu_ms is -1 if not known.
+    };
+    
+    Frame frames[latency];
+    int64_t frame_number = 0;
+    int depth = 0;
+    std::deque<std::vector<Event>> history;
+    bool clocks_synced = false;
+    double gpu_offset_us = 0; // CPU time minus GPU time.
+    clock::time_point start_time = clock::now();
+    
+    double now_us() const {
+        return std::chrono::duration<double, std::micro>(
+            clock::now() - start_time).count();
+    }
+    
+    Frame& current_frame() {
+        return frames[(frame_number + latency - 1) % latency];
+    }
+    
+    static GLuint next_query(Frame* frame) {
+        if (frame->queries_used == int(frame->queries.size())) {
+            GLuint id;
+            glGenQueries(1, &id);
+            frame->queries.push_back(id);
+        }
+        return frame->queries[frame->queries_used++];
+    }
+    
+    // Read the GPU times of a frame about to be reused, if they're
+    // available, and move its events to the history. Stages that
+    // never ended are dropped.
+    void collect(Frame* frame) {
+        if (frame->events.empty()) return;
+        GLint available = 0;
+        glGetQueryObjectiv(frame->queries[frame->queries_used - 1],
+                           GL_QUERY_RESULT_AVAILABLE, &available);
+        std::vector<Event> events;
+        for (Event event : frame->events) {
+            if (event.query_end == 0) continue;
+            if (available) {
+                GLuint64 begin_ns = 0, end_ns = 0;
+                glGetQueryObjectui64v(event.query_begin, GL_QUERY_RESULT, &begin_ns);
+                glGetQueryObjectui64v(event.query_end, GL_QUERY_RESULT, &end_ns);
+                event.gpu_begin_us = begin_ns * 1e-3 + gpu_offset_us;
+                event.gpu_end_us = end_ns * 1e-3 + gpu_offset_us;
+            }
+            events.push_back(event);
+        }
+        history.push_back(std::move(events));
+        if (int(history.size()) > history_frames) history.pop_front();
+    }
+    
+    static std::vector<StageTotal> stage_totals(std::vector<Event> const& events) {
+        std::vector<StageTotal> totals;
+        for (Event const& event : events) {
+            auto it = std::find_if(totals.begin(), totals.end(),
+                [&event] (StageTotal const& total) {
+                    return strcmp(total.name, event.name) == 0;
+                });
+            if (it == totals.end()) {
+                totals.push_back({ event.name, event.depth, 0.0, 0.0 });
+                it = totals.end() - 1;
+            }
+            it->cpu_ms += (event.cpu_end_us - event.cpu_begin_us) * 1e-3;
+            if (event.gpu_begin_us < 0) {
+                it->gpu_ms = -1;
+            } else if (it->gpu_ms >= 0) {
+                it->gpu_ms += (event.gpu_end_us - event.gpu_begin_us) * 1e-3;
+            }
+        }
+        return totals;
+    }
+};
+
+Profiler profiler;
+
+// Profile the enclosing block as a stage called name.
+class ProfileScope {
+    int event;
+    
+  public:
+    explicit ProfileScope(const char* name) : event(profiler.begin(name)) { }
+    ~ProfileScope() { profiler.end(event); }
+    
+    ProfileScope(ProfileScope const&) = delete;
+    ProfileScope& operator=(ProfileScope const&) = delete;
+};
+
+// glViewport, but also remember the viewport height so that draw_list
+// can pick sphere levels of detail without asking OpenGL for it.
+static void set_viewport(int width, int height) {
+    glViewport(0, 0, width, height);
+    viewport_height = height;
+}
+
+// Dynamic resolution (V toggles it, --target-fps turns it on with a
+// target): keeps a frame's GPU time under target_frame_ms by drawing
+// the main view into a smaller offscreen framebuffer that is stretched
+// onto the window with a linear blit, and by drawing the probes at a
+// smaller face size that is stretched onto the probe faces the same
+// way (see Ball::draw_probe).
+//
+// The two scales are controlled separately, from GPU timestamps taken
+// at the start of the frame, before the main view and after it, read
+// latency frames later so that nothing waits for the GPU. Over budget,
+// the probe scale drops first, since blurrier reflections show less
+// than a blurrier screen, and then the main view's; under budget the
+// main view comes back first. Pixel counts go with the square of the
+// scales. After each change the controller ignores settle_frames
+// frames, so that it only reacts to timings that include the change.
+class ResolutionScaler {
+  public:
+    // Call at the start of every frame, before the probes are drawn.
+    void begin_frame() {
+        if (!adaptive_resolution) {
+            main_scale = probe_scale = 1.0f;
+            timing = false;
+            return;
+        }
+        if (queries[0][0] == 0) glGenQueries(latency * 3, &queries[0][0]);
+        
+        int slot = int(frame_number++ % latency);
+        GLuint* frame_queries = queries[slot];
+        if (issued[slot]) {
+            GLuint available = 0;
+            glGetQueryObjectuiv(frame_queries[2], GL_QUERY_RESULT_AVAILABLE,
+                                &available);
+            if (available) {
+                GLuint64 ns[3];
+                for (int i = 0; i < 3; ++i) {
+                    glGetQueryObjectui64v(frame_queries[i], GL_QUERY_RESULT, &ns[i]);
+                }
+                update((ns[1] - ns[0]) * 1e-6f, (ns[2] - ns[1]) * 1e-6f);
+            }
+        }
+        issued[slot] = false;
+        glQueryCounter(frame_queries[0], GL_TIMESTAMP);
+        timing = true;
+    }
+    
+    // Bind the framebuffer to draw the width x height main view onto,
+    // and set the viewport to match.
+    void begin_main_view(int width, int height) {
+        if (timing) glQueryCounter(current_queries()[1], GL_TIMESTAMP);
+        if (main_scale >= 1.0f) {
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            set_viewport(width, height);
+            return;
+        }
+        int scaled_width = std::max(1, int(width * main_scale + 0.5f));
+        int scaled_height = std::max(1, int(height * main_scale + 0.5f));
+        resize_framebuffer(scaled_width, scaled_height);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_id);
+        set_viewport(scaled_width, scaled_height);
+    }
+    
+    // Stretch the main view onto framebuffer 0, if it was scaled, and
+    // leave that bound with a full-window viewport.
+    void end_main_view(int width, int height) {
+        if (main_scale < 1.0f) {
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer_id);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+            glBlitFramebuffer(0, 0, framebuffer_width, framebuffer_height,
+                              0, 0, width, height,
+                              GL_COLOR_BUFFER_BIT, GL_LINEAR);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            set_viewport(width, height);
+        }
+        if (timing) {
+            glQueryCounter(current_queries()[2], GL_TIMESTAMP);
+            issued[(frame_number - 1) % latency] = true;
+            timing = false;
+        }
+    }
+    
+    // The size to draw probe faces at, at most probe_dim.
+    int probe_face_dim() const {
+        if (probe_scale >= 1.0f) return probe_dim;
+        return std::min(probe_dim, std::max(min_probe_face_dim,
+                                            int(probe_dim * probe_scale)));
+    }
+    
+    void print_status() const {
+        printf("Resolution: main view %.0f%%, probes %dx%d, "
+               "%.1f ms GPU (target %.1f ms)\n",
+               100.0f * main_scale, probe_face_dim(), probe_face_dim(),
+               smoothed_ms, target_frame_ms);
+    }
+    
+  private:
+    static constexpr int latency = 4, settle_frames = 8;
+    static constexpr int min_probe_face_dim = 16;
+    static constexpr float min_main_scale = 0.5f, min_probe_scale = 0.25f;
+    
+    float main_scale = 1.0f, probe_scale = 1.0f;
+    float smoothed_ms = 0.0f;
+    int settle_countdown = 0;
+    GLuint queries[latency][3] = { { 0 } };
+    bool issued[latency] = { false };
+    bool timing = false;
+    int64_t frame_number = 0;
+    GLuint framebuffer_id = 0;
+    GLuint renderbuffers[2] = { 0, 0 }; // Color and depth.
+    int framebuffer_width = 0, framebuffer_height = 0;
+    
+    GLuint* current_queries() {
+        return queries[(frame_number - 1) % latency];
+    }
+    
+    void update(float probe_ms, float main_ms) {
+        float frame_ms = probe_ms + main_ms;
+        if (settle_countdown > 0) {
+            --settle_countdown;
+            smoothed_ms = frame_ms;
+            return;
+        }
+        smoothed_ms = 0.8f * smoothed_ms + 0.2f * frame_ms;
+        
+        if (smoothed_ms > 0.9f * target_frame_ms) {
+            if (probe_scale > min_probe_scale) {
+                probe_scale = std::max(min_probe_scale, probe_scale * 0.85f);
+            } else if (main_scale > min_main_scale) {
+                main_scale = std::max(min_main_scale, main_scale * 0.9f);
+            } else {
+                return;
+            }
+        } else if (smoothed_ms < 0.7f * target_frame_ms) {
+            if (main_scale < 1.0f) {
+                main_scale = std::min(1.0f, main_scale * 1.05f);
+            } else if (probe_scale < 1.0f) {
+                probe_scale = std::min(1.0f, probe_scale * 1.1f);
+            } else {
+                return;
+            }
         } else {
-            return false;
+            return;
+        }
+        settle_countdown = settle_frames;
+    }
+    
+    void resize_framebuffer(int width, int height) {
+        if (width == framebuffer_width && height == framebuffer_height) return;
+        PANIC_IF_GL_ERROR;
+        if (framebuffer_id == 0) {
+            glGenRenderbuffers(2, renderbuffers);
+            glGenFramebuffers(1, &framebuffer_id);
+        }
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_id);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  GL_RENDERBUFFER, renderbuffers[0]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                  GL_RENDERBUFFER, renderbuffers[1]);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            panic("Incomplete framebuffer", "scaled main view framebuffer");
+        }
+        framebuffer_width = width;
+        framebuffer_height = height;
+        PANIC_IF_GL_ERROR;
+    }
+};
+
+ResolutionScaler resolution_scaler;
+
+// Disk cache of linked program binaries, so that later runs can skip
+// compiling and linking shaders (make_program uses it). Entries are
+// keyed by a hash of the shader sources, the transform feedback
+// varyings and the driver's vendor, renderer and version strings. A
+// binary the driver rejects anyway (after a driver update, say) is
+// dropped and the program is compiled from source as usual. The whole
+// cache is one file next to the executable (argv0 + "Programs.cache"),
+// read by load() and rewritten by save() if anything changed. Without
+// ARB_get_program_binary the cache does nothing.
+class ProgramCache {
+  public:
+    // Call once, after the OpenGL context is current.
+    void load() {
+        get_program_binary = reinterpret_cast<program_binary::GetProgramBinaryProc>(
+            SDL_GL_GetProcAddress("glGetProgramBinary"));
+        program_binary_fn = reinterpret_cast<program_binary::ProgramBinaryProc>(
+            SDL_GL_GetProcAddress("glProgramBinary"));
+        program_parameteri = reinterpret_cast<program_binary::ProgramParameteriProc>(
+            SDL_GL_GetProcAddress("glProgramParameteri"));
+        GLint format_count = 0;
+        if (SDL_GL_ExtensionSupported("GL_ARB_get_program_binary")) {
+            glGetIntegerv(program_binary::num_binary_formats, &format_count);
+        }
+        enabled = format_count > 0 && get_program_binary
+               && program_binary_fn && program_parameteri;
+        if (!enabled) return;
+        
+        for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+            driver += reinterpret_cast<const char*>(glGetString(name));
+            driver += '\n';
+        }
+        path = argv0 + "Programs.cache";
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == nullptr) return;
+        fseek(file, 0, SEEK_END);
+        long file_size = ftell(file);
+        rewind(file);
+        
+        char magic[4];
+        if (fread(magic, 1, 4, file) == 4 && memcmp(magic, file_magic, 4) == 0) {
+            uint64_t key;
+            uint32_t header[2]; // Format, size.
+            while (fread(&key, sizeof key, 1, file) == 1
+                   && fread(header, sizeof header, 1, file) == 1) {
+                // A size past the end of the file means the rest is
+                // damaged; drop it rather than allocate that much.
+                if (header[1] > uint64_t(file_size - ftell(file))) break;
+                Entry& entry = entries[key];
+                entry.format = header[0];
+                entry.data.resize(header[1]);
+                if (fread(entry.data.data(), 1, header[1], file) != header[1]) {
+                    entries.erase(key);
+                    break;
+                }
+            }
+        }
+        fclose(file);
+    }
+    
+    // The cache key of a program.
+    uint64_t key(const char* vs_code, const char* fs_code, const char* gs_code,
+                 std::initializer_list<const char*> feedback_varyings) const {
+        // 64-bit FNV-1a over the strings, including their terminators.
+        uint64_t hash = 14695981039346656037ull;
+        auto add = [&hash] (const char* s) {
+            do {
+                hash = (hash ^ uint8_t(*s)) * 1099511628211ull;
+            } while (*s++ != '\0');
+        };
+        add(driver.c_str());
+        add(vs_code);
+        add(fs_code);
+        add(gs_code ? gs_code : "");
+        for (const char* varying : feedback_varyings) add(varying);
+        return hash;
+    }
+    
+    // Try to set up program_id from the cached binary for key. Returns
+    // true if it's now linked.
+    bool restore(GLuint program_id, uint64_t key) {
+        if (!enabled) return false;
+        auto it = entries.find(key);
+        if (it == entries.end()) return false;
+        
+        program_binary_fn(program_id, it->second.format,
+                          it->second.data.data(), GLsizei(it->second.data.size()));
+        GLint okay = 0;
+        glGetProgramiv(program_id, GL_LINK_STATUS, &okay);
+        if (okay) return true;
+        glGetError(); // A rejected binary may also set an error.
+        entries.erase(it);
+        dirty = true;
+        return false;
+    }
+    
+    // Call before linking a program that will be stored.
+    void prepare(GLuint program_id) {
+        if (enabled) {
+            program_parameteri(program_id, program_binary::retrievable_hint, GL_TRUE);
+        }
+    }
+    
+    // Add the binary of the linked program_id to the cache under key.
+    void store(GLuint program_id, uint64_t key) {
+        if (!enabled) return;
+        GLint length = 0;
+        glGetProgramiv(program_id, program_binary::binary_length, &length);
+        if (length <= 0) return;
+        
+        Entry entry;
+        entry.data.resize(length);
+        GLsizei written = 0;
+        get_program_binary(program_id, length, &written,
+                           &entry.format, entry.data.data());
+        entry.data.resize(written);
+        entries[key] = std::move(entry);
+        dirty = true;
+    }
+    
+    // Write the cache file back if it changed. A cache that can't be
+    // written is only worth a warning.
+    void save() {
+        if (!enabled || !dirty) return;
+        std::string temp_path = path + ".tmp";
+        FILE* file = fopen(temp_path.c_str(), "wb");
+        bool okay = file != nullptr && fwrite(file_magic, 1, 4, file) == 4;
+        for (auto const& pair : entries) {
+            if (!okay) break;
+            uint32_t header[2] = { pair.second.format,
+                                   uint32_t(pair.second.data.size()) };
+            okay = fwrite(&pair.first, sizeof pair.first, 1, file) == 1
+                && fwrite(header, sizeof header, 1, file) == 1
+                && fwrite(pair.second.data.data(), 1, header[1], file) == header[1];
+        }
+        if (file != nullptr && fclose(file) != 0) okay = false;
+        if (okay && rename(temp_path.c_str(), path.c_str()) == 0) {
+            dirty = false;
+        } else {
+            fprintf(stderr, "%s: Could not write program cache %s\n",
+                    argv0.c_str(), path.c_str());
+            remove(temp_path.c_str());
+        }
+    }
+    
+  private:
+    static constexpr char file_magic[4] = { 'B', 'P', 'C', '1' };
+    
+    struct Entry {
+        GLenum format = 0;
+        std::vector<char> data;
+    };
+    
+    bool enabled = false, dirty = false;
+    std::string driver, path;
+    std::map<uint64_t, Entry> entries;
+    program_binary::GetProgramBinaryProc get_program_binary = nullptr;
+    program_binary::ProgramBinaryProc program_binary_fn = nullptr;
+    program_binary::ProgramParameteriProc program_parameteri = nullptr;
+};
+
+constexpr char ProgramCache::file_magic[4];
+
+ProgramCache program_cache;
+
+// The per-view uniform block shared by every program that draws the
+// scene (see set_view_block). For the layered programs made by
+// make_layered_program, face_proj_matrix is the same as proj_matrix and
+// view_matrix is the plus x face's view matrix.
+#define VIEW_BLOCK_GLSL \
+    "layout(std140) uniform View {\n" \
+        "mat4 view_matrix;\n" \
+        "mat4 proj_matrix;\n" \
+        "mat4 face_view_matrices[6];\n" \
+        "mat4 face_proj_matrix;\n" \
+        "vec3 eye;\n" \
+        "int face_layer_base;\n" \
+    "};\n"
+
+constexpr GLuint view_block_binding = 0;
+
+// Attach the program's View block, if it has one, to view_block_binding.
+static void bind_view_block(GLuint program_id) {
+    GLuint index = glGetUniformBlockIndex(program_id, "View");
+    if (index != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program_id, index, view_block_binding);
+    }
+}
+
+// Compile and link a program from the given shader sources, or load it
+// from the program_cache. If feedback_varyings is not empty, those
+// vertex shader outputs are captured, interleaved, by transform
+// feedback.
+static GLuint make_program(
+    const char* vs_code, const char* fs_code, const char* gs_code=nullptr,
+    std::initializer_list<const char*> feedback_varyings={}
+) {
+    static GLchar log[1024];
+    PANIC_IF_GL_ERROR;
+    GLuint program_id = glCreateProgram();
+    uint64_t cache_key = program_cache.key(vs_code, fs_code, gs_code,
+                                           feedback_varyings);
+    if (program_cache.restore(program_id, cache_key)) {
+        bind_view_block(program_id);
+        return program_id;
+    }
+    
+    GLuint vs_id = glCreateShader(GL_VERTEX_SHADER);
+    GLuint fs_id = glCreateShader(GL_FRAGMENT_SHADER);
+    GLuint gs_id = gs_code ? glCreateShader(GL_GEOMETRY_SHADER) : 0;
+    
+    const GLchar* string_array[1];
+    string_array[0] = (GLchar*)vs_code;
+    glShaderSource(vs_id, 1, string_array, nullptr);
+    string_array[0] = (GLchar*)fs_code;
+    glShaderSource(fs_id, 1, string_array, nullptr);
+    if (gs_id) {
+        string_array[0] = (GLchar*)gs_code;
+        glShaderSource(gs_id, 1, string_array, nullptr);
+    }
+    
+    glCompileShader(vs_id);
+    glCompileShader(fs_id);
+    if (gs_id) glCompileShader(gs_id);
+    
+    PANIC_IF_GL_ERROR;
+    
+    GLint okay = 0;
+    GLsizei length = 0;
+    const GLuint shader_id_array[3] = { vs_id, fs_id, gs_id };
+    for (auto id : shader_id_array) {
+        if (id == 0) continue;
+        glGetShaderiv(id, GL_COMPILE_STATUS, &okay);
+        if (okay) {
+            glAttachShader(program_id, id);
+        } else {
+            glGetShaderInfoLog(id, sizeof log, &length, log);
+            fprintf(stderr, "%s\n",
+                id == vs_id ? vs_code : id == fs_id ? fs_code : gs_code);
+            panic("Shader compilation error", log);
+        }
+    }
+    
+    if (feedback_varyings.size() > 0) {
+        glTransformFeedbackVaryings(
+            program_id, GLsizei(feedback_varyings.size()),
+            feedback_varyings.begin(), GL_INTERLEAVED_ATTRIBS);
+    }
+    program_cache.prepare(program_id);
+    glLinkProgram(program_id);
+    glGetProgramiv(program_id, GL_LINK_STATUS, &okay);
+    if (!okay) {
+        glGetProgramInfoLog(program_id, sizeof log, &length, log);
+        panic("Shader link error", log);
+    }
+    program_cache.store(program_id, cache_key);
+    bind_view_block(program_id);
+    
+    PANIC_IF_GL_ERROR;
+    return program_id;
+}
+
+// Programs used for layered (single pass) cubemap rendering. The
+// vertex shader is compiled with LAYERED defined, in which case it
+// must leave the world space position in gl_Position instead of
+// projecting it (w = 0 for the skybox, which has no position). The
+// geometry shader generated here then emits each triangle six times,
+// once per cubemap face (leaving out faces that it is entirely
+// outside of), using face_view_matrices[6] and face_proj_matrix from
+// the View block, and writes gl_Layer = face_layer_base +
+// face to pick the face. Each listed (type, name) varying is renamed
+// to name_vs in the vertex shader and copied through by the geometry
+// shader; the type may start with an interpolation qualifier. The
+// fragment shader is also compiled with LAYERED defined, and can
+// declare "flat in int layered_face" to find out which face it's on.
+using VaryingList = std::initializer_list<std::pair<const char*, const char*>>;
+
+static GLuint make_layered_program(
+    const char* vs_code, const char* fs_code, VaryingList varyings
+) {
+    std::string defines = "#define LAYERED\n";
+    std::string gs_code =
+        "#version 330\n"
+        "layout(triangles) in;\n"
+        "layout(triangle_strip, max_vertices=18) out;\n"
+        VIEW_BLOCK_GLSL
+        "flat out int layered_face;\n";
+    std::string copy_varyings;
+    
+    for (auto const& varying : varyings) {
+        std::string type = varying.first, name = varying.second;
+        std::string qualifier;
+        if (type.compare(0, 5, "flat ") == 0) {
+            qualifier = "flat ";
+            type = type.substr(5);
+        }
+        defines += "#define " + name + " " + name + "_vs\n";
+        gs_code += qualifier + "in " + type + " " + name + "_vs[];\n";
+        gs_code += qualifier + "out " + type + " " + name + ";\n";
+        copy_varyings += name + " = " + name + "_vs[i];\n";
+    }
+    
+    gs_code +=
+        // True if the triangle is entirely outside one of the clip planes.
+        "bool outside(vec4 a, vec4 b, vec4 c) {\n"
+            "return (a.x > a.w && b.x > b.w && c.x > c.w)\n"
+                "|| (a.x < -a.w && b.x < -b.w && c.x < -c.w)\n"
+                "|| (a.y > a.w && b.y > b.w && c.y > c.w)\n"
+                "|| (a.y < -a.w && b.y < -b.w && c.y < -c.w)\n"
+                "|| (a.z > a.w && b.z > b.w && c.z > c.w)\n"
+                "|| (a.z < -a.w && b.z < -b.w && c.z < -c.w);\n"
+        "}\n"
+        "void main() {\n"
+            "for (int face = 0; face < 6; ++face) {\n"
+                "vec4 p[3];\n"
+                "for (int i = 0; i < 3; ++i) {\n"
+                    "vec4 v = face_view_matrices[face] * gl_in[i].gl_Position;\n"
+                    "p[i] = face_proj_matrix * vec4(v.xyz, 1.0);\n"
+                "}\n"
+                "if (outside(p[0], p[1], p[2])) continue;\n"
+                "for (int i = 0; i < 3; ++i) {\n"
+                    "gl_Position = p[i];\n"
+                    "gl_Layer = face_layer_base + face;\n"
+                    "layered_face = face;\n"
+                    + copy_varyings +
+                    "EmitVertex();\n"
+                "}\n"
+                "EndPrimitive();\n"
+            "}\n"
+        "}\n";
+    
+    // Insert the defines right after the #version line.
+    std::string layered_vs_code = vs_code;
+    layered_vs_code.insert(layered_vs_code.find('\n') + 1, defines);
+    std::string layered_fs_code = fs_code;
+    layered_fs_code.insert(layered_fs_code.find('\n') + 1, "#define LAYERED\n");
+    
+    return make_program(
+        layered_vs_code.c_str(), layered_fs_code.c_str(), gs_code.c_str()
+    );
+}
+
+// Where a layered draw goes: face i of the cubemap is drawn with
+// face_view_matrices[i] onto layer face_layer_base + i of the current
+// (layered) framebuffer.
+struct LayeredTarget {
+    glm::mat4 face_view_matrices[6];
+    int face_layer_base;
+};
+
+// The contents of the View block (VIEW_BLOCK_GLSL), laid out by std140
+// rules: each mat4 is 64 bytes and eye's vec3 is padded out by the
+// face_layer_base int that follows it.
+struct ViewBlock {
+    glm::mat4 view_matrix;
+    glm::mat4 proj_matrix;
+    glm::mat4 face_view_matrices[6];
+    glm::mat4 face_proj_matrix;
+    glm::vec3 eye;
+    int32_t face_layer_base;
+};
+static_assert(sizeof(ViewBlock) == 9*64 + 16, "ViewBlock must match std140");
+
+// Ring buffer for data the CPU writes and the GPU reads within a frame:
+// the per-view instance data and View blocks. It is split into
+// region_count regions, one per frame in flight. Every allocation of a
+// frame comes out of one region, and begin_frame fences that region
+// before moving on to the next, waiting for the fence the next region
+// got region_count frames ago (which has normally long signaled).
+// Writes therefore never hit the implicit sync of orphaning or
+// glBufferSubData on a buffer the GPU is still reading.
+//
+// With GL_ARB_buffer_storage the buffer is mapped once, persistently
+// and coherently, and map just returns a pointer into it. Otherwise
+// map maps only the allocated range, with GL_MAP_UNSYNCHRONIZED_BIT
+// (the fences do the synchronization) and GL_MAP_INVALIDATE_RANGE_BIT,
+// and unmap must be called before drawing from it. If a frame outgrows
+// its region the buffer is replaced by one with twice the room, so
+// id() must be read after map.
+class StreamBuffer {
+  public:
+    // Call once per frame, before anything is mapped.
+    void begin_frame() {
+        if (!retired_buffer_ids.empty()) {
+            glDeleteBuffers(GLsizei(retired_buffer_ids.size()),
+                            retired_buffer_ids.data());
+            retired_buffer_ids.clear();
+        }
+        if (buffer_id == 0) return;
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        region = (region + 1) % region_count;
+        used = 0;
+        if (fences[region] == nullptr) return;
+        while (glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                1000000000) == GL_TIMEOUT_EXPIRED) {
+        }
+        glDeleteSync(fences[region]);
+        fences[region] = nullptr;
+    }
+    
+    // Allocate size bytes (size > 0) from this frame's region, at an
+    // offset into the buffer (written to *offset_ptr) that is a
+    // multiple of alignment, and return a pointer for writing them.
+    void* map(GLsizeiptr size, GLsizeiptr alignment, GLintptr* offset_ptr) {
+        GLsizeiptr start = (used + alignment - 1) / alignment * alignment;
+        if (buffer_id == 0 || start + size > region_size) {
+            GLsizeiptr grown = buffer_id ? 2 * region_size : region_size;
+            reallocate(std::max(grown, size + alignment));
+            start = 0;
+        }
+        used = start + size;
+        mapped_start = start;
+        GLintptr offset = region * region_size + start;
+        *offset_ptr = offset;
+        if (persistent_pointer) return persistent_pointer + offset;
+        
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_id);
+        void* pointer = glMapBufferRange(
+            GL_COPY_WRITE_BUFFER, offset, size,
+            GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT
+            | GL_MAP_INVALIDATE_RANGE_BIT);
+        if (pointer == nullptr) {
+            panic("Could not map the stream buffer", "glMapBufferRange failed");
+        }
+        return pointer;
+    }
+    
+    // Finish writing the range returned by the last map. If
+    // written_size is given, only that many bytes at its start were
+    // written, and the rest of the range is handed out again.
+    void unmap(GLsizeiptr written_size=-1) {
+        if (written_size >= 0) used = mapped_start + written_size;
+        if (persistent_pointer) return;
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_id);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    }
+    
+    GLuint id() const {
+        return buffer_id;
+    }
+    
+  private:
+    static constexpr int region_count = 3;
+    
+    GLuint buffer_id = 0;
+    GLsizeiptr region_size = 128 * 1024;
+    int region = 0;
+    GLsizeiptr used = 0, mapped_start = 0;
+    GLsync fences[region_count] = { nullptr, nullptr, nullptr };
+    char* persistent_pointer = nullptr;
+    std::vector<GLuint> retired_buffer_ids;
+    
+    // Replace the buffer with one of region_count regions of at least
+    // min_region_size bytes each. The old buffer may still be bound
+    // (to the View block, say) for the rest of the frame, so it is only
+    // deleted at the next begin_frame; GL defers freeing it until the
+    // GPU is done with it.
+    void reallocate(GLsizeiptr min_region_size) {
+        static buffer_storage::BufferStorageProc buffer_storage_fn =
+            SDL_GL_ExtensionSupported("GL_ARB_buffer_storage")
+            ? reinterpret_cast<buffer_storage::BufferStorageProc>(
+                SDL_GL_GetProcAddress("glBufferStorage"))
+            : nullptr;
+        
+        for (GLsync& fence : fences) {
+            if (fence != nullptr) glDeleteSync(fence);
+            fence = nullptr;
+        }
+        if (buffer_id != 0) {
+            if (persistent_pointer) {
+                glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_id);
+                glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            }
+            retired_buffer_ids.push_back(buffer_id);
+        }
+        region_size = (min_region_size + 4095) / 4096 * 4096;
+        region = 0;
+        used = 0;
+        persistent_pointer = nullptr;
+        
+        GLsizeiptr size = region_count * region_size;
+        glGenBuffers(1, &buffer_id);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_id);
+        if (buffer_storage_fn) {
+            const GLbitfield flags = GL_MAP_WRITE_BIT
+                | buffer_storage::map_persistent_bit
+                | buffer_storage::map_coherent_bit;
+            buffer_storage_fn(GL_COPY_WRITE_BUFFER, size, nullptr, flags);
+            persistent_pointer = static_cast<char*>(glMapBufferRange(
+                GL_COPY_WRITE_BUFFER, 0, size, flags));
+            if (persistent_pointer == nullptr) {
+                panic("Could not map the stream buffer",
+                      "glMapBufferRange failed");
+            }
+        } else {
+            glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STREAM_DRAW);
+        }
+        PANIC_IF_GL_ERROR;
+    }
+};
+
+StreamBuffer stream_buffer;
+
+// Write a View block for a view into the stream_buffer and bind it to
+// view_block_binding for every program that draws it. This replaces
+// the view, projection and eye glUniform calls each program used to
+// make; draw_scene calls it once per view.
+static void set_view_block(
+    glm::mat4 view_matrix, glm::mat4 proj_matrix,
+    LayeredTarget const* layered_target
+) {
+    static GLint alignment = 0;
+    if (alignment == 0) {
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    }
+    
+    ViewBlock block;
+    block.view_matrix = view_matrix;
+    block.proj_matrix = proj_matrix;
+    for (int i = 0; i < 6; ++i) {
+        block.face_view_matrices[i] = layered_target
+            ? layered_target->face_view_matrices[i] : view_matrix;
+    }
+    block.face_proj_matrix = proj_matrix;
+    block.eye = glm::vec3(inverse(view_matrix) * glm::vec4(0,0,0,1));
+    block.face_layer_base = layered_target
+                          ? layered_target->face_layer_base : 0;
+    
+    GLintptr offset = 0;
+    void* pointer = stream_buffer.map(sizeof block, alignment, &offset);
+    memcpy(pointer, &block, sizeof block);
+    stream_buffer.unmap();
+    glBindBufferRange(GL_UNIFORM_BUFFER, view_block_binding,
+                      stream_buffer.id(), offset, sizeof block);
+    PANIC_IF_GL_ERROR;
+}
+
+// The planes of the view frustum of a view-projection matrix, with
+// normals pointing inward (the Gribb-Hartmann method).
+struct Frustum {
+    glm::vec4 planes[6];
+    
+    explicit Frustum(glm::mat4 m) {
+        glm::vec4 rows[4];
+        for (int i = 0; i < 4; ++i) {
+            rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+        }
+        for (int i = 0; i < 3; ++i) {
+            planes[2*i] = rows[3] + rows[i];
+            planes[2*i+1] = rows[3] - rows[i];
+        }
+        for (glm::vec4& plane : planes) {
+            plane = plane * (1.0f / glm::length(glm::vec3(plane)));
+        }
+    }
+    
+    bool intersects_sphere(glm::vec3 center, float radius) const {
+        for (glm::vec4 const& plane : planes) {
+            if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Optional GPU backend for the physics (--physics gpu). The state of
+// the balls lives in buffer objects of State records (ball i is record
+// i), and each step runs a vertex shader over the balls with transform
+// feedback from one buffer into the other, since OpenGL 3.3 has no
+// compute shaders. draw_list reads the positions and radii straight
+// from the newest buffer (see Ball::gpu_state_buffer), so nothing has
+// to be uploaded per frame. Steps run on the render thread, at the
+// same sim_period_ms rate as the Simulation thread.
+//
+// Wall bounces and the integrators match BallPhysics. Ball-ball
+// collisions use a uniform grid like BallPhysics does, built on the
+// GPU in a few more transform feedback passes over the old state
+// (read through buffer textures):
+//
+// 1. Each ball writes a (cell, ball) key, padded to a power of two
+//    with keys past every cell.
+// 2. A bitonic sort, one pass per compare-and-swap stage, sorts the
+//    keys by cell.
+// 3. Each ball finds the lowest numbered ball it would bounce with in
+//    its own and the neighbouring cells, by binary searching the
+//    sorted keys for each of the nine rows of cells around it.
+// 4. The main pass swaps the velocities of every two balls that found
+//    each other, so bounces are pairwise exchanges as in bounce_balls.
+//
+// A ball whose partner found a different ball waits for a later step.
+// The lowest numbered ball with any partner is always found back, so
+// contacts never stall, but where three or more balls touch at once
+// the pairs can differ from the ones bounce_balls picks, and the two
+// backends drift apart. Each step bounces balls before moving them,
+// which is BallPhysics::step's order shifted by half a step.
+//
+// The positions and radii are also copied back to the CPU, without
+// ever waiting for the GPU, for the parts of the renderer that need
+// them there (probe placement and the probe scheduler):
+// read_positions gets the newest copy that has arrived, which is
+// usually a frame or two old. With a Recorder, every step's copy is
+// also handed to it in step order; for that, step waits for a copy
+// still in flight instead of skipping the readback.
+// The grid cells of GpuPhysics, with the same clamping as UniformGrid.
+#define GPU_GRID_GLSL \
+    "uniform vec3 box_min;\n" \
+    "uniform float cell_size;\n" \
+    "uniform ivec3 grid_dim;\n" \
+    "ivec3 grid_cell(vec3 p) {\n" \
+        "vec3 c = floor((p - box_min) / cell_size);\n" \
+        "return ivec3(clamp(c, vec3(0.0), vec3(grid_dim - 1)));\n" \
+    "}\n" \
+    "int cell_index(ivec3 c) {\n" \
+        "return (c.z * grid_dim.y + c.y) * grid_dim.x + c.x;\n" \
+    "}\n"
+
+class GpuPhysics {
+  public:
+    struct State {
+        glm::vec3 position;
+        float radius;
+        glm::vec3 velocity;
+        float unused;
+    };
+    
+    explicit GpuPhysics(BallPhysics const& initial, Recorder* recorder_arg=nullptr)
+        : ball_count(initial.size()), max_radius(initial.max_radius()),
+          recorder(recorder_arg), recorded_state(initial) {
+        static const char key_vs_source[] =
+            "#version 330\n"
+            "uniform samplerBuffer state;\n"
+            "uniform int ball_count;\n"
+            GPU_GRID_GLSL
+            "flat out ivec2 key;\n" // Cell, ball.
+            "void main() {\n"
+                "int i = gl_VertexID;\n"
+                "if (i >= ball_count) {\n"
+                    "key = ivec2(2147483647, i);\n"
+                "} else {\n"
+                    "key = ivec2(cell_index(grid_cell(texelFetch(state, 2*i).xyz)), i);\n"
+                "}\n"
+            "}\n"
+        ;
+        // One compare-and-swap stage of a bitonic sort: sorts blocks of
+        // block keys, alternately up and down, merging at stride.
+        static const char sort_vs_source[] =
+            "#version 330\n"
+            "uniform isamplerBuffer keys;\n"
+            "uniform int block;\n"
+            "uniform int stride;\n"
+            "flat out ivec2 sorted_key;\n"
+            "bool less(ivec2 a, ivec2 b) {\n"
+                "return a.x < b.x || (a.x == b.x && a.y < b.y);\n"
+            "}\n"
+            "void main() {\n"
+                "int i = gl_VertexID, other = i ^ stride;\n"
+                "ivec2 a = texelFetch(keys, i).xy, b = texelFetch(keys, other).xy;\n"
+                "bool take_min = (i < other) == ((i & block) == 0);\n"
+                "sorted_key = less(a, b) == take_min ? a : b;\n"
+            "}\n"
+        ;
+        static const char partner_vs_source[] =
+            "#version 330\n"
+            "uniform samplerBuffer state;\n" // 2 texels per ball.
+            "uniform isamplerBuffer keys;\n" // Sorted by cell.
+            "uniform int ball_count;\n"
+            GPU_GRID_GLSL
+            "flat out int partner;\n" // Or -1 if none.
+            
+            // The index of the first key with a cell of at least cell.
+            "int first_key(int cell) {\n"
+                "int lo = 0, hi = ball_count;\n"
+                "while (lo < hi) {\n"
+                    "int mid = (lo + hi) / 2;\n"
+                    "if (texelFetch(keys, mid).x < cell) lo = mid + 1;\n"
+                    "else hi = mid;\n"
+                "}\n"
+                "return lo;\n"
+            "}\n"
+            
+            "void main() {\n"
+                "int i = gl_VertexID;\n"
+                "vec4 position_radius = texelFetch(state, 2*i);\n"
+                "vec3 v = texelFetch(state, 2*i + 1).xyz;\n"
+                "ivec3 c = grid_cell(position_radius.xyz);\n"
+                "int found = -1;\n"
+                "for (int z = max(c.z-1, 0); z <= min(c.z+1, grid_dim.z-1); ++z) {\n"
+                    "for (int y = max(c.y-1, 0); y <= min(c.y+1, grid_dim.y-1); ++y) {\n"
+                        "int row = (z * grid_dim.y + y) * grid_dim.x;\n"
+                        "int last = row + min(c.x+1, grid_dim.x-1);\n"
+                        "int k = first_key(row + max(c.x-1, 0));\n"
+                        "for (; k < ball_count; ++k) {\n"
+                            "ivec2 key = texelFetch(keys, k).xy;\n"
+                            "if (key.x > last) break;\n"
+                            "int j = key.y;\n"
+                            "if (j == i || (found >= 0 && j > found)) continue;\n"
+                            
+                            // Same test as BallPhysics::would_bounce,
+                            // which gives the same answer for j and i.
+                            "vec4 other = texelFetch(state, 2*j);\n"
+                            "vec3 d = other.xyz - position_radius.xyz;\n"
+                            "float radii = position_radius.w + other.w;\n"
+                            "if (dot(d, d) >= radii*radii) continue;\n"
+                            "vec3 other_v = texelFetch(state, 2*j + 1).xyz;\n"
+                            "if (dot(d, v - other_v) > 0.0) found = j;\n"
+                        "}\n"
+                    "}\n"
+                "}\n"
+                "partner = found;\n"
+            "}\n"
+        ;
+        static const char vs_source[] =
+            "#version 330\n"
+            "uniform samplerBuffer state;\n" // 2 texels per ball.
+            "uniform isamplerBuffer partners;\n"
+            "uniform int integrator;\n" // int(Integrator)
+            "uniform float frame_dt;\n"
+            "uniform int substeps;\n"
+            "uniform float gravity;\n"
+            "uniform vec3 box_min;\n"
+            "uniform vec3 box_max;\n"
+            "layout(location=0) in vec4 position_radius;\n"
+            "layout(location=1) in vec4 velocity;\n"
+            "out vec4 new_position_radius;\n"
+            "out vec4 new_velocity;\n"
+            "const float never = 1e30;\n"
+            
+            // BallPhysics::time_of_impact, with never for infinity.
+            "float time_of_impact(float p, float v, float a, float w,\n"
+            "                     float s, float max_t) {\n"
+                "float roots[2];\n"
+                "int root_count = 0;\n"
+                "if (a == 0.0) {\n"
+                    "if (v != 0.0) { roots[0] = (w - p) / v; root_count = 1; }\n"
+                "} else {\n"
+                    "float discriminant = v*v - 2.0*a*(p - w);\n"
+                    "if (discriminant >= 0.0) {\n"
+                        "float q = sqrt(discriminant);\n"
+                        "float t0 = (-v - q) / a, t1 = (-v + q) / a;\n"
+                        "roots[0] = min(t0, t1);\n"
+                        "roots[1] = max(t0, t1);\n"
+                        "root_count = 2;\n"
+                    "}\n"
+                "}\n"
+                "for (int k = 0; k < root_count; ++k) {\n"
+                    "float t = roots[k];\n"
+                    "if (t > 0.0 && t <= max_t && s * (v + a*t) > 0.0) return t;\n"
+                "}\n"
+                "return never;\n"
+            "}\n"
+            
+            // One axis of BallPhysics::bounce_bounds.
+            "void bounce_wall(inout float p, inout float v,\n"
+            "                 float r, float lo, float hi) {\n"
+                "if (p + r > hi && v > 0.0) { v = -v; p = hi - r; }\n"
+                "if (p - r < lo && v < 0.0) { v = -v; p = lo + r; }\n"
+            "}\n"
+            
+            // BallPhysics::advance_axis.
+            "void advance_axis(inout float p, inout float v, float r,\n"
+            "                  float lo, float hi, float a, float dt) {\n"
+                "bounce_wall(p, v, r, lo, hi);\n"
+                "int bounce = 0;\n"
+                "for (; bounce < 64; ++bounce) {\n"
+                    "float t_hi = time_of_impact(p, v, a, hi - r, +1.0, dt);\n"
+                    "float t_lo = time_of_impact(p, v, a, lo + r, -1.0, dt);\n"
+                    "float t = min(t_hi, t_lo);\n"
+                    "if (t == never) break;\n"
+                    "v = -(v + a*t);\n"
+                    "p = t_hi < t_lo ? hi - r : lo + r;\n"
+                    "dt -= t;\n"
+                "}\n"
+                "p += v*dt + 0.5*a*dt*dt;\n"
+                "v += a*dt;\n"
+                "if (bounce == 64) p = clamp(p, lo + r, hi - r);\n"
+            "}\n"
+            
+            "void main() {\n"
+                "vec3 p = position_radius.xyz;\n"
+                "float r = position_radius.w;\n"
+                "vec3 v = velocity.xyz;\n"
+                
+                // Swap velocities with the partner, if it found this
+                // ball too (it then takes this ball's velocity).
+                "int j = texelFetch(partners, gl_VertexID).x;\n"
+                "if (j >= 0 && texelFetch(partners, j).x == gl_VertexID) {\n"
+                    "v = texelFetch(state, 2*j + 1).xyz;\n"
+                "}\n"
+                
+                "if (integrator == 2) {\n" // continuous
+                    "advance_axis(p.x, v.x, r, box_min.x, box_max.x, 0.0, frame_dt);\n"
+                    "advance_axis(p.y, v.y, r, box_min.y, box_max.y, -gravity, frame_dt);\n"
+                    "advance_axis(p.z, v.z, r, box_min.z, box_max.z, 0.0, frame_dt);\n"
+                "} else {\n"
+                    "bounce_wall(p.x, v.x, r, box_min.x, box_max.x);\n"
+                    "bounce_wall(p.y, v.y, r, box_min.y, box_max.y);\n"
+                    "bounce_wall(p.z, v.z, r, box_min.z, box_max.z);\n"
+                    "if (integrator == 1) {\n" // closed_form
+                        "p += v*frame_dt;\n"
+                        "p.y -= 0.5*gravity*frame_dt*frame_dt;\n"
+                        "v.y -= gravity*frame_dt;\n"
+                    "} else {\n" // euler_substeps
+                        "float dt = frame_dt / float(substeps);\n"
+                        "for (int s = 0; s < substeps; ++s) {\n"
+                            "v.y -= dt*gravity;\n"
+                            "p += v*dt;\n"
+                        "}\n"
+                    "}\n"
+                "}\n"
+                
+                "new_position_radius = vec4(p, r);\n"
+                "new_velocity = vec4(v, 0.0);\n"
+            "}\n"
+        ;
+        static const char fs_source[] =
+            "#version 330\n"
+            "void main() { }\n"
+        ;
+        
+        PANIC_IF_GL_ERROR;
+        std::vector<State> states(ball_count);
+        for (int i = 0; i < ball_count; ++i) {
+            states[i].position = initial.position(i);
+            states[i].radius = initial.radius[i];
+            states[i].velocity = glm::vec3(initial.vx[i], initial.vy[i], initial.vz[i]);
+            states[i].unused = 0.0f;
+        }
+        GLsizeiptr size = sizeof(State) * states.size();
+        
+        glGenBuffers(2, state_buffers);
+        glGenVertexArrays(2, vaos);
+        glGenTextures(2, state_textures);
+        for (int k = 0; k < 2; ++k) {
+            glBindBuffer(GL_ARRAY_BUFFER, state_buffers[k]);
+            glBufferData(GL_ARRAY_BUFFER, size, states.data(), GL_DYNAMIC_COPY);
+            
+            glBindVertexArray(vaos[k]);
+            glVertexAttribPointer(0, 4, GL_FLOAT, false, sizeof(State),
+                                  (void*)offsetof(State, position));
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(1, 4, GL_FLOAT, false, sizeof(State),
+                                  (void*)offsetof(State, velocity));
+            glEnableVertexAttribArray(1);
+            
+            glBindTexture(GL_TEXTURE_BUFFER, state_textures[k]);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, state_buffers[k]);
+        }
+        
+        sort_count = 1;
+        while (sort_count < ball_count) sort_count *= 2;
+        glGenBuffers(2, key_buffers);
+        glGenTextures(2, key_textures);
+        for (int k = 0; k < 2; ++k) {
+            glBindBuffer(GL_ARRAY_BUFFER, key_buffers[k]);
+            glBufferData(GL_ARRAY_BUFFER, 2 * sizeof(GLint) * sort_count,
+                         nullptr, GL_DYNAMIC_COPY);
+            glBindTexture(GL_TEXTURE_BUFFER, key_textures[k]);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32I, key_buffers[k]);
+        }
+        glGenBuffers(1, &partner_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, partner_buffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLint) * std::max(1, ball_count),
+                     nullptr, GL_DYNAMIC_COPY);
+        glGenTextures(1, &partner_texture);
+        glBindTexture(GL_TEXTURE_BUFFER, partner_texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, partner_buffer);
+        glGenVertexArrays(1, &empty_vao); // For the passes without attributes.
+        
+        glBindVertexArray(0);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        
+        for (Readback& readback : readbacks) {
+            glGenBuffers(1, &readback.buffer_id);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, readback.buffer_id);
+            glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STREAM_READ);
+        }
+        
+        key_program_id = make_program(key_vs_source, fs_source, nullptr, { "key" });
+        key_grid = grid_uniforms(key_program_id);
+        glUseProgram(key_program_id);
+        glUniform1i(glGetUniformLocation(key_program_id, "state"), 0);
+        
+        sort_program_id = make_program(sort_vs_source, fs_source, nullptr,
+                                       { "sorted_key" });
+        block_idx = glGetUniformLocation(sort_program_id, "block");
+        stride_idx = glGetUniformLocation(sort_program_id, "stride");
+        glUseProgram(sort_program_id);
+        glUniform1i(glGetUniformLocation(sort_program_id, "keys"), 0);
+        
+        partner_program_id = make_program(partner_vs_source, fs_source, nullptr,
+                                          { "partner" });
+        partner_grid = grid_uniforms(partner_program_id);
+        glUseProgram(partner_program_id);
+        glUniform1i(glGetUniformLocation(partner_program_id, "state"), 0);
+        glUniform1i(glGetUniformLocation(partner_program_id, "keys"), 1);
+        
+        program_id = make_program(vs_source, fs_source, nullptr,
+                                  { "new_position_radius", "new_velocity" });
+        glUseProgram(program_id);
+        glUniform1i(glGetUniformLocation(program_id, "state"), 0);
+        glUniform1i(glGetUniformLocation(program_id, "partners"), 1);
+        glUseProgram(0);
+        integrator_idx = glGetUniformLocation(program_id, "integrator");
+        frame_dt_idx = glGetUniformLocation(program_id, "frame_dt");
+        substeps_idx = glGetUniformLocation(program_id, "substeps");
+        gravity_idx = glGetUniformLocation(program_id, "gravity");
+        box_min_idx = glGetUniformLocation(program_id, "box_min");
+        box_max_idx = glGetUniformLocation(program_id, "box_max");
+        PANIC_IF_GL_ERROR;
+    }
+    
+    ~GpuPhysics() {
+        if (recorder) {
+            // Record the steps still in flight, oldest first.
+            std::vector<Readback*> pending;
+            for (Readback& readback : readbacks) {
+                if (readback.fence) pending.push_back(&readback);
+            }
+            std::sort(pending.begin(), pending.end(),
+                      [] (Readback* a, Readback* b) { return a->step < b->step; });
+            for (Readback* readback : pending) record_readback(readback);
+        }
+        for (Readback& readback : readbacks) {
+            if (readback.fence) glDeleteSync(readback.fence);
+            glDeleteBuffers(1, &readback.buffer_id);
+        }
+        glDeleteProgram(program_id);
+        glDeleteProgram(partner_program_id);
+        glDeleteProgram(sort_program_id);
+        glDeleteProgram(key_program_id);
+        glDeleteVertexArrays(1, &empty_vao);
+        glDeleteTextures(1, &partner_texture);
+        glDeleteBuffers(1, &partner_buffer);
+        glDeleteTextures(2, key_textures);
+        glDeleteBuffers(2, key_buffers);
+        glDeleteTextures(2, state_textures);
+        glDeleteVertexArrays(2, vaos);
+        glDeleteBuffers(2, state_buffers);
+    }
+    
+    GpuPhysics(GpuPhysics const&) = delete;
+    GpuPhysics& operator=(GpuPhysics const&) = delete;
+    
+    // The buffer holding the newest state.
+    GLuint state_buffer() const {
+        return state_buffers[current];
+    }
+    
+    // Advance the simulation by one frame of length frame_dt, like
+    // BallPhysics::step, and start copying the new state back.
+    void step(float frame_dt, Integrator integrator) {
+        int next = 1 - current;
+        glEnable(GL_RASTERIZER_DISCARD);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_BUFFER, state_textures[current]);
+        glBindVertexArray(empty_vao);
+        
+        // Key the balls by grid cell, with UniformGrid::build's cell size.
+        float volume = (max_x - min_x) * (max_y - min_y) * (max_z - min_z);
+        float cell_size = std::max(2.0f * max_radius,
+                                   cbrtf(volume / std::max(1, 8 * ball_count)));
+        glUseProgram(key_program_id);
+        set_grid_uniforms(key_grid, cell_size);
+        feedback_pass(key_buffers[0], sort_count);
+        
+        // Sort the keys by cell.
+        int sorted = 0;
+        glUseProgram(sort_program_id);
+        for (int block = 2; block <= sort_count; block *= 2) {
+            for (int stride = block / 2; stride > 0; stride /= 2) {
+                glUniform1i(block_idx, block);
+                glUniform1i(stride_idx, stride);
+                glBindTexture(GL_TEXTURE_BUFFER, key_textures[sorted]);
+                feedback_pass(key_buffers[1 - sorted], sort_count);
+                sorted = 1 - sorted;
+            }
+        }
+        
+        // Find each ball's partner.
+        glUseProgram(partner_program_id);
+        set_grid_uniforms(partner_grid, cell_size);
+        glBindTexture(GL_TEXTURE_BUFFER, state_textures[current]);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_BUFFER, key_textures[sorted]);
+        feedback_pass(partner_buffer, ball_count);
+        
+        // Bounce the partners and move the balls.
+        glUseProgram(program_id);
+        glUniform1i(integrator_idx, int(integrator));
+        glUniform1f(frame_dt_idx, frame_dt);
+        glUniform1i(substeps_idx, ticks_per_frame);
+        glUniform1f(gravity_idx, gravity);
+        glUniform3f(box_min_idx, min_x, min_y, min_z);
+        glUniform3f(box_max_idx, max_x, max_y, max_z);
+        glBindTexture(GL_TEXTURE_BUFFER, partner_texture);
+        glBindVertexArray(vaos[current]);
+        feedback_pass(state_buffers[next], ball_count);
+        
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindVertexArray(0);
+        glDisable(GL_RASTERIZER_DISCARD);
+        current = next;
+        
+        // Copy the new state to the next readback buffer, unless that
+        // one's copy hasn't finished either, in which case this step
+        // just isn't read back. When recording, every step has to be,
+        // so wait for that copy (the oldest in flight) and record it.
+        Readback& readback = readbacks[step_count % readback_count];
+        if (readback.fence != nullptr && recorder) record_readback(&readback);
+        ++step_count;
+        if (readback.fence == nullptr) {
+            glBindBuffer(GL_COPY_READ_BUFFER, state_buffers[current]);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, readback.buffer_id);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                                0, 0, sizeof(State) * ball_count);
+            readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            readback.step = step_count;
+        }
+        DRAW_PANIC_IF_GL_ERROR;
+    }
+    
+    // Copy the positions, velocities and radii of the newest state that
+    // has made it back to the CPU to *out, which must have the same
+    // number of balls. Leaves *out alone, and returns false, if no newer
+    // copy has arrived. With a recorder, also records every copy that
+    // arrived, not just the newest.
+    bool read_positions(BallPhysics* out) {
+        assert(out->size() == ball_count);
+        Readback* arrived[readback_count];
+        int arrived_count = 0;
+        for (Readback& readback : readbacks) {
+            if (readback.fence == nullptr) continue;
+            GLenum status = glClientWaitSync(
+                readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+                continue;
+            }
+            glDeleteSync(readback.fence);
+            readback.fence = nullptr;
+            arrived[arrived_count++] = &readback;
+        }
+        // Fences signal in order, so these are all older than any copy
+        // still in flight.
+        std::sort(arrived, arrived + arrived_count,
+                  [] (Readback* a, Readback* b) { return a->step < b->step; });
+        for (int i = 0; recorder && i < arrived_count; ++i) {
+            copy_readback(*arrived[i], &recorded_state);
+            recorder->record(recorded_state);
+        }
+        
+        if (arrived_count == 0) return false;
+        Readback const* newest = arrived[arrived_count - 1];
+        if (newest->step <= read_step) return false;
+        read_step = newest->step;
+        copy_readback(*newest, out);
+        return true;
+    }
+    
+    // Replace *out with the whole current state, velocities included.
+    // Waits for the steps in flight to finish; for saving the scene,
+    // not for every frame.
+    void read_state(BallPhysics* out) {
+        glBindBuffer(GL_COPY_READ_BUFFER, state_buffers[current]);
+        auto states = static_cast<State const*>(glMapBufferRange(
+            GL_COPY_READ_BUFFER, 0, sizeof(State) * ball_count, GL_MAP_READ_BIT));
+        if (states == nullptr) {
+            panic("Could not map buffer", "(GpuPhysics state)");
+        }
+        out->clear();
+        for (int i = 0; i < ball_count; ++i) {
+            out->add(states[i].position, states[i].velocity, states[i].radius);
+        }
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+    }
+    
+  private:
+    static constexpr int readback_count = 3;
+    
+    struct Readback {
+        GLuint buffer_id = 0;
+        GLsync fence = nullptr; // Pending copy, if not null.
+        int64_t step = 0;       // step_count after the copied step.
+    };
+    
+    // Uniforms of GPU_GRID_GLSL, and the ball count, in one program.
+    struct GridUniforms {
+        GLint ball_count, box_min, cell_size, grid_dim;
+    };
+    
+    int ball_count;
+    float max_radius;
+    Recorder* recorder;
+    BallPhysics recorded_state; // Scratch space for recording readbacks.
+    GLuint state_buffers[2];
+    GLuint vaos[2];           // Reading state_buffers[k].
+    GLuint state_textures[2]; // Buffer textures of state_buffers[k].
+    int current = 0;
+    Readback readbacks[readback_count];
+    int64_t step_count = 0, read_step = 0;
+    
+    int sort_count;           // ball_count rounded up to a power of two.
+    GLuint key_buffers[2];    // sort_count (cell, ball) keys, GL_RG32I.
+    GLuint key_textures[2];   // Buffer textures of key_buffers[k].
+    GLuint partner_buffer;    // ball_count partners, GL_R32I.
+    GLuint partner_texture;
+    GLuint empty_vao;
+    
+    GLuint key_program_id, sort_program_id, partner_program_id;
+    GridUniforms key_grid, partner_grid;
+    GLint block_idx, stride_idx;
+    
+    GLuint program_id;
+    GLint integrator_idx, frame_dt_idx;
+    GLint substeps_idx, gravity_idx, box_min_idx, box_max_idx;
+    
+    static GridUniforms grid_uniforms(GLuint program_id) {
+        GridUniforms result;
+        result.ball_count = glGetUniformLocation(program_id, "ball_count");
+        result.box_min = glGetUniformLocation(program_id, "box_min");
+        result.cell_size = glGetUniformLocation(program_id, "cell_size");
+        result.grid_dim = glGetUniformLocation(program_id, "grid_dim");
+        return result;
+    }
+    
+    // Set the uniforms of the current program for a grid of cells
+    // cell_size across over the box.
+    void set_grid_uniforms(GridUniforms const& uniforms, float cell_size) const {
+        glUniform1i(uniforms.ball_count, ball_count);
+        glUniform3f(uniforms.box_min, min_x, min_y, min_z);
+        glUniform1f(uniforms.cell_size, cell_size);
+        glUniform3i(uniforms.grid_dim,
+                    std::max(1, int(ceilf((max_x - min_x) / cell_size))),
+                    std::max(1, int(ceilf((max_y - min_y) / cell_size))),
+                    std::max(1, int(ceilf((max_z - min_z) / cell_size))));
+    }
+    
+    // Run the current program over count points, capturing its outputs
+    // into buffer_id.
+    static void feedback_pass(GLuint buffer_id, int count) {
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, buffer_id);
+        glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, 0, count);
+        glEndTransformFeedback();
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    }
+    
+    // Copy the state in a readback buffer whose copy has finished to
+    // *out, which must have the same number of balls.
+    void copy_readback(Readback const& readback, BallPhysics* out) {
+        glBindBuffer(GL_COPY_READ_BUFFER, readback.buffer_id);
+        auto states = static_cast<State const*>(glMapBufferRange(
+            GL_COPY_READ_BUFFER, 0, sizeof(State) * ball_count, GL_MAP_READ_BIT));
+        if (states == nullptr) {
+            panic("Could not map buffer", "(GpuPhysics readback)");
+        }
+        for (int i = 0; i < ball_count; ++i) {
+            out->x[i] = states[i].position[0];
+            out->y[i] = states[i].position[1];
+            out->z[i] = states[i].position[2];
+            out->vx[i] = states[i].velocity[0];
+            out->vy[i] = states[i].velocity[1];
+            out->vz[i] = states[i].velocity[2];
+            out->radius[i] = states[i].radius;
+        }
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+    }
+    
+    // Wait for the copy of a readback in flight, then hand its state to
+    // the recorder and free the readback for another step.
+    void record_readback(Readback* readback) {
+        while (glClientWaitSync(readback->fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                1000000000) == GL_TIMEOUT_EXPIRED) {
+        }
+        glDeleteSync(readback->fence);
+        readback->fence = nullptr;
+        copy_readback(*readback, &recorded_state);
+        recorder->record(recorded_state);
+    }
+};
+
+// To do reflections on each ball, we will associate six 2d texture
+// faces (+/- xyz) to each ball in the scene. We will render a "skybox"
+// from the perspective of each ball and sample reflections from this
+// skybox.
+//
+// The faces of every ball live in one 2D array texture (the probe
+// array), six consecutive layers per probe slot, so that all balls
+// can be drawn with one instanced draw call and one texture bind.
+// Cubemap array textures would be the natural fit, but they need
+// OpenGL 4.0, so shaders find the face and texture coordinate
+// themselves (SAMPLE_PROBE_GLSL below, using the same rules OpenGL
+// uses for cubemaps).
+//
+// Probes are drawn one at a time, so they all share one depth texture
+// with six layers. A probe is never drawn straight into the probe
+// array: the balls drawn into it sample the probe array, and drawing
+// to a texture while sampling it is a feedback loop with undefined
+// results, even with a different layer attached. So the faces are
+// drawn into a six-layer scratch color texture, all six in one pass
+// through the layered framebuffer or one at a time through the
+// scratch framebuffers (one per face), and then blitted into the
+// probe's layers through the face framebuffer, which only ever has
+// the probe array layer being written or read attached.
+//
+// Probe slots are pooled: freed slots are reused, and when none are
+// free the probe array grows by half (at least probe_chunk_slots
+// slots), copying the existing probes over, up to max_probe_slots().
+// Balls don't own slots; ProbeScheduler takes slots for the probes it
+// draws and gives them back when it stops using them, so the array
+// only grows with the number of probes actually in use, not with the
+// number of balls.
+constexpr int probe_chunk_slots = 16;
+
+struct ProbeArray {
+    GLuint color_texture = 0;
+    GLuint depth_texture = 0;
+    GLuint scratch_texture = 0;
+    GLuint layered_framebuffer = 0;
+    GLuint face_framebuffer = 0;
+    GLuint scratch_framebuffers[6] = { 0 };
+    int capacity = 0;
+    std::vector<int> free_slots; // Lowest slot last.
+};
+
+ProbeArray probe_array;
+
+static void set_probe_texture_parameters() {
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+}
+
+// Create the textures and framebuffers shared by all probes.
+static void init_probe_array() {
+    PANIC_IF_GL_ERROR;
+    glGenTextures(1, &probe_array.depth_texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, probe_array.depth_texture);
+    set_probe_texture_parameters();
+    glTexImage3D(
+        GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, probe_dim, probe_dim, 6, 0,
+        GL_DEPTH_COMPONENT, GL_FLOAT, 0
+    );
+    glGenTextures(1, &probe_array.scratch_texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, probe_array.scratch_texture);
+    set_probe_texture_parameters();
+    glTexImage3D(
+        GL_TEXTURE_2D_ARRAY, 0, probe_format, probe_dim, probe_dim, 6, 0,
+        GL_RGB, GL_FLOAT, 0
+    );
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    PANIC_IF_GL_ERROR;
+    
+    const GLenum tmp = GL_COLOR_ATTACHMENT0;
+    glGenFramebuffers(1, &probe_array.layered_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, probe_array.layered_framebuffer);
+    glFramebufferTexture(
+        GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, probe_array.depth_texture, 0
+    );
+    glFramebufferTexture(
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, probe_array.scratch_texture, 0
+    );
+    glDrawBuffers(1, &tmp);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        panic("Incomplete framebuffer", "layered probe framebuffer");
+    }
+    
+    glGenFramebuffers(1, &probe_array.face_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, probe_array.face_framebuffer);
+    glDrawBuffers(1, &tmp);
+    
+    // Framebuffers for drawing single faces (at full size or reduced
+    // by the ResolutionScaler) and for blitting the scratch faces.
+    glGenFramebuffers(6, probe_array.scratch_framebuffers);
+    for (int i = 0; i < 6; ++i) {
+        glBindFramebuffer(GL_FRAMEBUFFER, probe_array.scratch_framebuffers[i]);
+        glFramebufferTextureLayer(
+            GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+            probe_array.depth_texture, 0, i
+        );
+        glFramebufferTextureLayer(
+            GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            probe_array.scratch_texture, 0, i
+        );
+        glDrawBuffers(1, &tmp);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    PANIC_IF_GL_ERROR;
+}
+
+// Bind the face framebuffer (as GL_FRAMEBUFFER, or as target if
+// given) with face face of probe slot slot attached, as the target of
+// a blit or the source of a copy. Never draw to it: see ProbeArray.
+static void bind_probe_face(int slot, int face, GLenum target=GL_FRAMEBUFFER) {
+    glBindFramebuffer(target, probe_array.face_framebuffer);
+    glFramebufferTextureLayer(
+        target, GL_COLOR_ATTACHMENT0,
+        probe_array.color_texture, 0, 6 * slot + face
+    );
+}
+
+// Copy the bottom left dim x dim of scratch face face onto face face
+// of probe slot slot, stretching it if dim is less than probe_dim.
+static void blit_scratch_face(int slot, int face, int dim) {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, probe_array.scratch_framebuffers[face]);
+    bind_probe_face(slot, face, GL_DRAW_FRAMEBUFFER);
+    glBlitFramebuffer(0, 0, dim, dim, 0, 0, probe_dim, probe_dim,
+                      GL_COLOR_BUFFER_BIT, dim < probe_dim ? GL_LINEAR : GL_NEAREST);
+}
+
+// Copy face_count faces, starting from face first_face (mod 6), of
+// probe slot from_slot to probe slot to_slot.
+static void copy_probe_faces(int from_slot, int to_slot, int first_face,
+                             int face_count) {
+    glBindTexture(GL_TEXTURE_2D_ARRAY, probe_array.color_texture);
+    for (int n = 0; n < face_count; ++n) {
+        int face = (first_face + n) % 6;
+        bind_probe_face(from_slot, face, GL_READ_FRAMEBUFFER);
+        glCopyTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 6 * to_slot + face,
+                            0, 0, probe_dim, probe_dim);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+// The most probes the probe array can hold: as many as fit in both
+// GL_MAX_ARRAY_TEXTURE_LAYERS and probe_memory_budget_mb, but at least
+// five: the sky probe's slot, the scene probe's two, and two for one
+// ball's own probe.
+static int max_probe_slots() {
+    static int result = 0;
+    if (result == 0) {
+        GLint max_layers = 0;
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+        double slot_bytes = 6.0 * probe_dim * probe_dim
+                          * (probe_format == GL_RGBA16F ? 8 : 4);
+        double budget_slots = probe_memory_budget_mb * 1048576.0 / slot_bytes;
+        result = std::max(5, std::min(int(max_layers) / 6,
+                                      int(std::min(budget_slots, 1e6))));
+    }
+    return result;
+}
+
+// Reallocate the probe array with room for new_capacity probes,
+// copying the faces of the existing probes into the new texture.
+static void grow_probe_array(int new_capacity) {
+    new_capacity = std::min(new_capacity, max_probe_slots());
+    if (new_capacity <= probe_array.capacity) {
+        panic("Too many reflection probes", "max_probe_slots()");
+    }
+    if (probe_array.capacity == 0) init_probe_array();
+    
+    PANIC_IF_GL_ERROR;
+    GLuint old_texture = probe_array.color_texture;
+    glGenTextures(1, &probe_array.color_texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, probe_array.color_texture);
+    set_probe_texture_parameters();
+    glTexImage3D(
+        GL_TEXTURE_2D_ARRAY, 0, probe_format,
+        probe_dim, probe_dim, 6 * new_capacity, 0, GL_RGB, GL_FLOAT, 0
+    );
+    
+    if (old_texture != 0) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, probe_array.face_framebuffer);
+        for (int layer = 0; layer < 6 * probe_array.capacity; ++layer) {
+            glFramebufferTextureLayer(
+                GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, old_texture, 0, layer
+            );
+            glReadBuffer(GL_COLOR_ATTACHMENT0);
+            glCopyTexSubImage3D(
+                GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, 0, 0, probe_dim, probe_dim
+            );
+        }
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        glDeleteTextures(1, &old_texture);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    PANIC_IF_GL_ERROR;
+    
+    for (int slot = new_capacity - 1; slot >= probe_array.capacity; --slot) {
+        probe_array.free_slots.push_back(slot);
+    }
+    probe_array.capacity = new_capacity;
+}
+
+// Returns an unused probe slot, growing the probe array if needed.
+static int new_probe_slot() {
+    if (probe_array.free_slots.empty()) {
+        grow_probe_array(probe_array.capacity
+                         + std::max(probe_chunk_slots, probe_array.capacity / 2));
+    }
+    int slot = probe_array.free_slots.back();
+    probe_array.free_slots.pop_back();
+    return slot;
+}
+
+// Return a probe slot to the pool.
+static void free_probe_slot(int slot) {
+    probe_array.free_slots.push_back(slot);
+}
+
+// GLSL function for sampling face layers of the probe array like a
+// cubemap. For a direction vector, the face is chosen by the major
+// axis and the texture coordinates follow the table in the OpenGL
+// spec (section 8.13, "Cube Map Texture Selection").
+#define SAMPLE_PROBE_GLSL \
+    "vec4 sample_probe(sampler2DArray probes, float slot, vec3 r) {\n" \
+        "vec3 a = abs(r);\n" \
+        "float face, sc, tc, ma;\n" \
+        "if (a.x >= a.y && a.x >= a.z) {\n" \
+            "face = r.x > 0.0 ? 0.0 : 1.0;\n" \
+            "sc = r.x > 0.0 ? -r.z : r.z;\n" \
+            "tc = -r.y;\n" \
+            "ma = a.x;\n" \
+        "} else if (a.y >= a.z) {\n" \
+            "face = r.y > 0.0 ? 2.0 : 3.0;\n" \
+            "sc = r.x;\n" \
+            "tc = r.y > 0.0 ? r.z : -r.z;\n" \
+            "ma = a.y;\n" \
+        "} else {\n" \
+            "face = r.z > 0.0 ? 4.0 : 5.0;\n" \
+            "sc = r.z > 0.0 ? r.x : -r.x;\n" \
+            "tc = -r.y;\n" \
+            "ma = a.z;\n" \
+        "}\n" \
+        "vec2 st = 0.5 * vec2(sc, tc) / ma + 0.5;\n" \
+        "return texture(probes, vec3(st, 6.0*slot + face));\n" \
+    "}\n"
+
+class Ball;
+
+// All the balls in the scene: their physics state, plus their colors
+// stored in a separate array (indexed the same way). The balls are
+// accessed through Ball handles.
+class BallList {
+  public:
+    BallPhysics physics;
+    std::vector<glm::vec3> color;
+    
+    BallList() = default;
+    BallList(BallList const&) = delete;
+    
+    int size() const {
+        return physics.size();
+    }
+    
+    void emplace_back(glm::vec3 pos_arg, glm::vec3 vel_arg,
+                      float r_arg, float g_arg, float b_arg, float radius_arg);
+    void clear();
+    
+    Ball operator[](int i) const;
+};
+
+static void draw_skybox(LayeredTarget const* layered_target=nullptr);
+
+static void draw_scene(
+    glm::mat4 view_matrix, glm::mat4 proj_matrix,
+    BallList const& list, int skip=-1,
+    LayeredTarget const* layered_target=nullptr,
+    bool occlusion_cull=false, bool draw_balls=true
+);
+
+// Ball is a lightweight handle to ball number index of a BallList.
+// The OpenGL draw calls all come from here.
+class Ball {
+    BallList const* list;
+    int index;
+    
+    // Per-instance data for the instanced sphere draws, refreshed by
+    // upload_instances. Layout matches the attributes set up by
+    // bind_instance_attributes. Each draw_list writes the instances it
+    // draws into the stream_buffer, starting at instance_offset.
+    struct Instance {
+        glm::vec3 sphere_origin;
+        float radius;
+        glm::vec3 color;
+        float probe_slot;
+    };
+    static std::vector<Instance> instances;
+    static GLintptr instance_offset;
+    static int instance_count;
+  public:
+    Ball(BallList const* list_arg, int index_arg) {
+        list = list_arg;
+        index = index_arg;
+    }
+    
+    glm::vec3 position() const {
+        return list->physics.position(index);
+    }
+    
+    float radius() const {
+        return list->physics.radius[index];
+    }
+    
+    // Copy the position, radius, color and probe slot of every ball
+    // into the instance data read by draw_list. Call this once per
+    // frame, after the balls have moved and before anything is drawn;
+    // it also starts the stream_buffer's new frame.
+    // Ball i reflects probe slot probe_slots[i].
+    static void upload_instances(BallList const& list, int const* probe_slots) {
+        instances.resize(list.size());
+        for (int i = 0; i < list.size(); ++i) {
+            Instance& instance = instances[i];
+            instance.sphere_origin = list.physics.position(i);
+            instance.radius = list.physics.radius[i];
+            instance.color = list.color[i];
+            instance.probe_slot = float(probe_slots[i]);
+        }
+        instance_count = int(instances.size());
+        stream_buffer.begin_frame();
+    }
+    
+    // Change the probe slot each ball reflects, as for the probe_slots
+    // argument of upload_instances, for the draws after this.
+    static void set_probe_slots(int const* probe_slots) {
+        for (int i = 0; i < instance_count; ++i) {
+            instances[i].probe_slot = float(probe_slots[i]);
+        }
+    }
+    
+    // Set up the per-instance vertex attributes (locations 1 through
+    // 4) of the currently bound vertex array, starting from instance
+    // first_instance of the instances written by the last draw_list.
+    static void bind_instance_attributes(int first_instance=0) {
+        static const struct {
+            GLint size;
+            size_t offset;
+        } attributes[4] = {
+            { 3, offsetof(Instance, sphere_origin) },
+            { 1, offsetof(Instance, radius) },
+            { 3, offsetof(Instance, color) },
+            { 1, offsetof(Instance, probe_slot) },
+        };
+        const size_t base = instance_offset + first_instance * sizeof(Instance);
+        glBindBuffer(GL_ARRAY_BUFFER, stream_buffer.id());
+        for (GLuint i = 0; i < 4; ++i) {
+            glVertexAttribPointer(
+                i+1,
+                attributes[i].size,
+                GL_FLOAT,
+                false,
+                sizeof(Instance),
+                (void*)(base + attributes[i].offset)
+            );
+            glVertexAttribDivisor(i+1, 1);
+            glEnableVertexAttribArray(i+1);
+        }
+    }
+    
+    // If not 0, the balls' positions and radii are drawn from this
+    // buffer of GpuPhysics::State records instead of the instance data.
+    static GLuint gpu_state_buffer;
+    
+    // Sphere level of detail used for every ball with gpu_state_buffer,
+    // where the positions aren't on the CPU to pick levels from.
+    static constexpr int gpu_physics_lod = 1;
+    
+    // A run of count instances, starting at instance first_instance of
+    // the view's instances, drawn at sphere level of detail lod. If
+    // first_ball >= 0, their positions and radii come from balls
+    // first_ball onward of gpu_state_buffer instead.
+    struct DrawSegment {
+        int first_instance;
+        int first_ball;
+        int count;
+        int lod;
+    };
+    
+    // bind_instance_attributes for the instances of a segment.
+    static void bind_segment(DrawSegment const& segment) {
+        bind_instance_attributes(segment.first_instance);
+        if (segment.first_ball < 0) return;
+        const GLsizei stride = sizeof(GpuPhysics::State);
+        size_t base = segment.first_ball * sizeof(GpuPhysics::State);
+        glBindBuffer(GL_ARRAY_BUFFER, gpu_state_buffer);
+        glVertexAttribPointer(1, 3, GL_FLOAT, false, stride,
+            (void*)(base + offsetof(GpuPhysics::State, position)));
+        glVertexAttribPointer(2, 1, GL_FLOAT, false, stride,
+            (void*)(base + offsetof(GpuPhysics::State, radius)));
+    }
+    
+    // Draw the segments of the view's instances as impostors: one quad
+    // per ball facing the eye, with the fragment shader intersecting
+    // each pixel's eye ray with the ball's core and shell spheres. That
+    // gives the same look as the three mesh passes of draw_list
+    // (reflective core, refracting shell back faces and translucent
+    // shell front faces) in one pass, with exact silhouettes and depths
+    // written to gl_FragDepth. Arguments are as for draw_list.
+    static void draw_impostors(
+        std::vector<DrawSegment> const& segments,
+        LayeredTarget const* layered_target
+    ) {
+        static bool initialized = false;
+        static GLuint vao;
+        static GLuint corner_buffer_id;
+        static GLuint program_id[2];
+        
+        static GLint core_radius_ratio_idx[2];
+        static GLint probe_array_idx[2];
+        
+        static const char vs_source[] =
+            "#version 330\n"
+            "precision mediump float;\n"
+            VIEW_BLOCK_GLSL
+            
+            "layout(location=0) in vec2 corner;\n"
+            "layout(location=1) in vec3 sphere_origin;\n"
+            "layout(location=2) in float radius;\n"
+            "layout(location=3) in vec3 color;\n"
+            "layout(location=4) in float probe_slot;\n"
+            
+            "out vec3 quad_pos;\n"
+            "flat out vec3 center;\n"
+            "flat out float sphere_radius;\n"
+            "flat out vec3 surface_color;\n"
+            "flat out float slot;\n"
+            "void main() {\n"
+                "vec3 forward = sphere_origin - eye;\n"
+                "float d = length(forward);\n"
+                "forward /= d;\n"
+                "vec3 side = abs(forward.y) < 0.99 ? vec3(0,1,0) : vec3(1,0,0);\n"
+                "vec3 right = normalize(cross(forward, side));\n"
+                "vec3 up = cross(right, forward);\n"
+                // Half size of a quad through the center that covers
+                // the sphere's silhouette; nothing if the eye is inside.
+                "float s = d > radius ? radius*d / sqrt(d*d - radius*radius) : 0.0;\n"
+                "quad_pos = sphere_origin + s*(corner.x*right + corner.y*up);\n"
+            "#ifdef LAYERED\n"
+                "gl_Position = vec4(quad_pos, 1.0);\n"
+            "#else\n"
+                "gl_Position = proj_matrix * view_matrix * vec4(quad_pos, 1.0);\n"
+            "#endif\n"
+                "center = sphere_origin;\n"
+                "sphere_radius = radius;\n"
+                "surface_color = color;\n"
+                "slot = probe_slot;\n"
+            "}\n"
+        ;
+        static const char fs_source[] =
+            "#version 330\n"
+            "precision mediump float;\n"
+            "uniform sampler2DArray probe_array;\n"
+            VIEW_BLOCK_GLSL
+            "uniform float core_radius_ratio;\n"
+            "#ifdef LAYERED\n"
+            "flat in int layered_face;\n"
+            "#endif\n"
+            
+            "in vec3 quad_pos;\n"
+            "flat in vec3 center;\n"
+            "flat in float sphere_radius;\n"
+            "flat in vec3 surface_color;\n"
+            "flat in float slot;\n"
+            "layout(location=0) out vec4 fragment_color;\n"
+            SAMPLE_PROBE_GLSL
+            "void main() {\n"
+                "vec3 dir = normalize(quad_pos - eye);\n"
+                "vec3 oc = eye - center;\n"
+                "float b = dot(dir, oc);\n"
+                "float c = dot(oc, oc);\n"
+                "float outer_disc = b*b - c + sphere_radius*sphere_radius;\n"
+                "if (outer_disc < 0.0) discard;\n"
+                "float core_radius = core_radius_ratio * sphere_radius;\n"
+                "float core_disc = b*b - c + core_radius*core_radius;\n"
+                
+                "vec3 base, depth_pos;\n"
+                "if (core_disc >= 0.0) {\n"
+                    "depth_pos = eye + (-b - sqrt(core_disc))*dir;\n"
+                    "vec3 normal = (depth_pos - center) / core_radius;\n"
+                    "base = 0.25*surface_color\n"
+                    "     + 0.75*sample_probe(probe_array, slot, reflect(dir, normal)).rgb;\n"
+                "} else {\n"
+                    "depth_pos = eye + (-b + sqrt(outer_disc))*dir;\n"
+                    "vec3 normal = (center - depth_pos) / sphere_radius;\n"
+                    "base = sample_probe(probe_array, slot, refract(dir, normal, 0.64)).rgb;\n"
+                "}\n"
+                
+                "vec3 front = eye + (-b - sqrt(outer_disc))*dir;\n"
+                "float Dot = dot(-dir, (front - center) / sphere_radius);\n"
+                "float f = Dot*Dot*0.6;\n"
+                "fragment_color = vec4(mix(base, vec3(f), 0.4-Dot*0.15), 1.0);\n"
+                
+            "#ifdef LAYERED\n"
+                "vec4 v = face_view_matrices[layered_face] * vec4(depth_pos, 1.0);\n"
+                "vec4 clip = face_proj_matrix * vec4(v.xyz, 1.0);\n"
+            "#else\n"
+                "vec4 clip = proj_matrix * view_matrix * vec4(depth_pos, 1.0);\n"
+            "#endif\n"
+                "gl_FragDepth = 0.5 + 0.5 * clip.z / clip.w;\n"
+            "}\n"
+        ;
+        
+        if (!initialized) {
+            PANIC_IF_GL_ERROR;
+            program_id[0] = make_program(vs_source, fs_source);
+            program_id[1] = make_layered_program(vs_source, fs_source,
+                { {"vec3", "quad_pos"}, {"flat vec3", "center"},
+                  {"flat float", "sphere_radius"},
+                  {"flat vec3", "surface_color"}, {"flat float", "slot"} });
+            
+            for (int i = 0; i < 2; ++i) {
+                GLuint id = program_id[i];
+                core_radius_ratio_idx[i] = glGetUniformLocation(id, "core_radius_ratio");
+                probe_array_idx[i] = glGetUniformLocation(id, "probe_array");
+            }
+            
+            static const float corners[] = { -1,-1, 1,-1, -1,1, 1,1 };
+            glGenVertexArrays(1, &vao);
+            glBindVertexArray(vao);
+            glGenBuffers(1, &corner_buffer_id);
+            glBindBuffer(GL_ARRAY_BUFFER, corner_buffer_id);
+            glBufferData(GL_ARRAY_BUFFER, sizeof corners, corners, GL_STATIC_DRAW);
+            glVertexAttribPointer(0, 2, GL_FLOAT, false, 2*sizeof(float), (void*)0);
+            glEnableVertexAttribArray(0);
+            bind_instance_attributes();
+            PANIC_IF_GL_ERROR;
+            
+            initialized = true;
+        }
+        
+        const int layered = layered_target != nullptr;
+        
+        glUseProgram(program_id[layered]);
+        glBindVertexArray(vao);
+        
+        glUniform1f(core_radius_ratio_idx[layered], ball_core_radius_ratio);
+        
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, probe_array.color_texture);
+        glUniform1i(probe_array_idx[layered], 0);
+        
+        // The quads always face the eye, but which way they wind
+        // depends on the view, so don't cull them.
+        ProfileScope scope("balls impostors");
+        glDisable(GL_CULL_FACE);
+        for (DrawSegment const& segment : segments) {
+            if (segment.count == 0) continue;
+            bind_segment(segment);
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, segment.count);
+        }
+        glEnable(GL_CULL_FACE);
+        glBindVertexArray(0);
+        DRAW_PANIC_IF_GL_ERROR;
+    }
+    
+    // Occlusion query state of each ball for the main view. A ball
+    // whose proxy touched no samples last time is left out of the next
+    // main view draws, and its query keeps running so that it comes
+    // back once it is uncovered. Results are only read once available,
+    // so this never waits for the GPU; a ball shows up (or disappears)
+    // a frame or two late instead.
+    struct OcclusionQuery {
+        GLuint id = 0;
+        bool pending = false;
+        bool visible = true;
+    };
+    static std::vector<OcclusionQuery> occlusion_queries;
+    
+    static void read_occlusion_queries() {
+        occlusion_queries.resize(instance_count);
+        for (auto& query : occlusion_queries) {
+            if (!query.pending) continue;
+            GLint available = 0;
+            glGetQueryObjectiv(query.id, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) continue;
+            GLint any_samples = 0;
+            glGetQueryObjectiv(query.id, GL_QUERY_RESULT, &any_samples);
+            query.visible = any_samples != 0;
+            query.pending = false;
+        }
+    }
+    
+    // Test every ball against the current depth buffer by drawing a
+    // proxy sphere (the given index range of the sphere mesh, scaled to
+    // enclose the ball) inside an occlusion query, for balls whose
+    // previous query has finished. The view is the current View block.
+    static void issue_occlusion_queries(
+        GLuint vertex_buffer_id, GLuint index_buffer_id,
+        int first_index, int index_count
+    ) {
+        ProfileScope scope("occlusion queries");
+        static GLuint vao = 0;
+        static GLuint program_id;
+        static GLint sphere_idx;
+        
+        static const char vs_source[] =
+            "#version 330\n"
+            VIEW_BLOCK_GLSL
+            "uniform vec4 sphere;\n"
+            "layout(location=0) in vec3 sphere_coord;\n"
+            "void main() {\n"
+                "vec3 coord = sphere.w*sphere_coord + sphere.xyz;\n"
+                "gl_Position = proj_matrix * view_matrix * vec4(coord, 1.0);\n"
+            "}\n"
+        ;
+        static const char fs_source[] =
+            "#version 330\n"
+            "layout(location=0) out vec4 fragment_color;\n"
+            "void main() { fragment_color = vec4(0.0); }\n"
+        ;
+        if (vao == 0) {
+            PANIC_IF_GL_ERROR;
+            program_id = make_program(vs_source, fs_source);
+            sphere_idx = glGetUniformLocation(program_id, "sphere");
+            
+            glGenVertexArrays(1, &vao);
+            glBindVertexArray(vao);
+            glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_id);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_id);
+            glVertexAttribPointer(0, 3, GL_FLOAT, false, 3*sizeof(float), (void*)0);
+            glEnableVertexAttribArray(0);
+            PANIC_IF_GL_ERROR;
+        }
+        
+        glUseProgram(program_id);
+        glBindVertexArray(vao);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glDepthMask(GL_FALSE);
+        
+        for (int i = 0; i < instance_count; ++i) {
+            OcclusionQuery& query = occlusion_queries[i];
+            if (query.pending) continue;
+            if (query.id == 0) glGenQueries(1, &query.id);
+            
+            // The coarse mesh's faces cut inside the sphere; scale it up
+            // so that it encloses the whole ball.
+            glm::vec4 sphere(instances[i].sphere_origin, 1.35f * instances[i].radius);
+            glUniform4fv(sphere_idx, 1, &sphere[0]);
+            glBeginQuery(GL_ANY_SAMPLES_PASSED, query.id);
+            glDrawElements(GL_TRIANGLES, index_count, GL_UNSIGNED_SHORT,
+                           (void*)(first_index * sizeof(GLushort)));
+            glEndQuery(GL_ANY_SAMPLES_PASSED);
+            query.pending = true;
         }
+        
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glDepthMask(GL_TRUE);
+        glBindVertexArray(0);
     }
     
-    // Returns true (and modifies velocity) if we are beyond the edge
-    // of the bounding box (min/max x y z) and our speed is such that
-    // we're moving further out.
-    //
-    // Sets the bounce flag to true if we bounced.
-    bool bounce_bounds() {
-        bool flag = false;
+    // Sort the instances to draw in a view (leaving out the skipped
+    // ball and culled balls) into view_instances, which has room for
+    // instance_count, by level of detail, with one segment per level.
+    // The level is picked from the ball's projected radius in pixels.
+    // Arguments are as for draw_list.
+    static void sort_view_instances(
+        glm::mat4 view_matrix,
+        glm::mat4 proj_matrix,
+        int skip,
+        LayeredTarget const* layered_target,
+        bool occlusion_cull,
+        Instance* view_instances,
+        std::vector<DrawSegment>* segments
+    ) {
+        static std::vector<int> instance_lod;
+        int lod_begin[sphere_lod_count + 1] = { 0 };
+        instance_lod.resize(instances.size());
         
-        if (position[0] + radius > max_x && velocity[0] > 0) {
-            velocity[0] *= -1.0f;
-            position[0] = max_x - radius;
-            flag = true;
-        }
-        if (position[1] + radius > max_y && velocity[1] > 0) {
-            velocity[1] *= -1.0f;
-            position[1] = max_y - radius;
-            flag = true;
+        int frustum_count = layered_target ? 6 : 1;
+        static std::vector<Frustum> frusta;
+        frusta.assign(frustum_count, Frustum(proj_matrix * view_matrix));
+        for (int f = 0; layered_target && f < 6; ++f) {
+            frusta[f] = Frustum(proj_matrix * layered_target->face_view_matrices[f]);
         }
-        if (position[2] + radius > max_z && velocity[2] > 0) {
-            velocity[2] *= -1.0f;
-            position[2] = max_z - radius;
-            flag = true;
+        if (occlusion_cull) read_occlusion_queries();
+        
+        for (int i = 0; i < instance_count; ++i) {
+            instance_lod[i] = -1;
+            if (i == skip) continue;
+            if (occlusion_cull && !occlusion_queries[i].visible) continue;
+            bool in_frustum = false;
+            for (Frustum const& frustum : frusta) {
+                in_frustum = in_frustum || frustum.intersects_sphere(
+                    instances[i].sphere_origin, instances[i].radius);
+            }
+            if (!in_frustum) continue;
+            
+            glm::vec4 center = view_matrix * glm::vec4(instances[i].sphere_origin, 1);
+            float distance = std::max(glm::length(glm::vec3(center)),
+                                      instances[i].radius);
+            float pixels = instances[i].radius / distance
+                         * proj_matrix[1][1] * 0.5f * viewport_height;
+            int lod = 0;
+            while (!impostor_balls && lod < sphere_lod_count-1
+                   && pixels < sphere_lod_min_pixels[lod]) {
+                ++lod;
+            }
+            instance_lod[i] = lod;
+            ++lod_begin[lod + 1];
         }
-        if (position[0] - radius < min_x && velocity[0] < 0) {
-            velocity[0] *= -1.0f;
-            position[0] = min_x + radius;
-            flag = true;
+        for (int lod = 0; lod < sphere_lod_count; ++lod) {
+            lod_begin[lod + 1] += lod_begin[lod];
         }
-        if (position[1] - radius < min_y && velocity[1] < 0) {
-            velocity[1] *= -1.0f;
-            position[1] = min_y + radius;
-            flag = true;
+        int lod_end[sphere_lod_count];
+        std::copy(lod_begin, lod_begin + sphere_lod_count, lod_end);
+        for (int i = 0; i < instance_count; ++i) {
+            int lod = instance_lod[i];
+            if (lod >= 0) view_instances[lod_end[lod]++] = instances[i];
         }
-        if (position[2] - radius < min_z && velocity[2] < 0) {
-            velocity[2] *= -1.0f;
-            position[2] = min_z + radius;
-            flag = true;
+        
+        segments->clear();
+        for (int lod = 0; lod < sphere_lod_count; ++lod) {
+            segments->push_back({ lod_begin[lod], -1,
+                                  lod_begin[lod+1] - lod_begin[lod], lod });
         }
-        bounced |= flag;
-        return flag;
-    }
-    
-    bool bounce_flag() const {
-        return bounced;
-    }
-    
-    void reset_bounce_flag() {
-        bounced = false;
     }
     
-    // Euler method tick: update position using velocity and velocity
-    // using gravity acceleration.
-    void tick(float dt) {
-        velocity -= glm::vec3(0.0f, dt*gravity, 0.0f);
-        position += velocity * dt;
+    // The instances to draw with gpu_state_buffer: all but skip, in
+    // ball order, in at most two segments around skip. Arguments are as
+    // for sort_view_instances.
+    static void gpu_view_instances(
+        int skip,
+        Instance* view_instances,
+        std::vector<DrawSegment>* segments
+    ) {
+        segments->clear();
+        if (skip < 0 || skip >= instance_count) {
+            std::copy(instances.begin(), instances.end(), view_instances);
+            segments->push_back({ 0, 0, instance_count, gpu_physics_lod });
+            return;
+        }
+        std::copy(instances.begin(), instances.begin() + skip, view_instances);
+        std::copy(instances.begin() + skip + 1, instances.end(),
+                  view_instances + skip);
+        segments->push_back({ 0, 0, skip, gpu_physics_lod });
+        segments->push_back({ skip, skip + 1, instance_count - skip - 1,
+                              gpu_physics_lod });
     }
     
     // Draw a list of Balls onto the current framebuffer, skipping the
-    // ball pointed-to by the skip pointer (if any). The provided view
-    // and projection matrices are used in the ordinary way.
+    // ball with index skip (if any). The provided view and projection
+    // matrices are used in the ordinary way.
+    //
+    // If layered_target is not null, the current framebuffer is the
+    // layered probe framebuffer and the balls are drawn onto all six
+    // faces of a probe at once (view_matrix is then only used to find
+    // the eye position).
+    //
+    // Balls are drawn with one instanced draw call per program and
+    // sphere level of detail, using the data from the last
+    // upload_instances call, which must have been passed the same list.
+    // Each ball's level of detail is picked from its projected radius in
+    // this view, so balls drawn into probes, which are small there, get
+    // coarser meshes than the same balls on screen. With
+    // impostor_balls, the balls are drawn by draw_impostors instead.
+    //
+    // Balls outside the view frustum (outside all six face frusta for
+    // a layered target) aren't drawn. With occlusion_cull, which is
+    // meant for the main view, balls found hidden by the previous
+    // occlusion queries aren't drawn either, and new queries are
+    // issued after drawing. With gpu_state_buffer there is no culling
+    // and every ball is drawn at gpu_physics_lod.
     static void draw_list(
         glm::mat4 view_matrix,
         glm::mat4 proj_matrix,
         BallList const& list,
-        Ball const* skip=nullptr
+        int skip=-1,
+        LayeredTarget const* layered_target=nullptr,
+        bool occlusion_cull=false
     ) {
+        assert(list.size() == instance_count);
         static bool buffers_initialized = false;
-        static GLuint vertex_buffer_id;
-        static int vertex_count;
+        static GLuint vertex_buffer_id, index_buffer_id;
+        static int lod_first_index[sphere_lod_count];
+        static int lod_index_count[sphere_lod_count];
         
-        // Initialize a vertex buffer with vertices of sphere with
-        // radius 1 suitable for use with GL_TRIANGLES draw mode.
+        // Initialize vertex and index buffers with indexed meshes of a
+        // sphere with radius 1, one per level of detail, suitable for
+        // use with GL_TRIANGLES draw mode.
         if (!buffers_initialized) {
             std::vector<glm::vec3> coord_vector;
+            std::vector<GLushort> index_vector;
             
-            const float magic = 5;
-            
-            auto add_face = [&coord_vector, magic]
-            (glm::vec3 a_vec, glm::vec3 b_vec, glm::vec3 face_vec) {
-                for (float a = -magic; a < magic; ++a) {
-                    for (float b = -magic; b < magic; ++b) {
-                        glm::vec3 coord0 = a*a_vec + b*b_vec + face_vec;
-                        coord0 = normalize(coord0);
-                        glm::vec3 coord1 = (a+1)*a_vec + b*b_vec + face_vec;
-                        coord1 = normalize(coord1);
-                        glm::vec3 coord2 = a*a_vec + (b+1)*b_vec + face_vec;
-                        coord2 = normalize(coord2);
-                        glm::vec3 coord3 = (a+1)*a_vec + (b+1)*b_vec + face_vec;
-                        coord3 = normalize(coord3);
-                        
-                        coord_vector.push_back(coord0);
-                        coord_vector.push_back(coord1);
-                        coord_vector.push_back(coord3);
-                        coord_vector.push_back(coord0);
-                        coord_vector.push_back(coord3);
-                        coord_vector.push_back(coord2);
+            auto add_face = [&coord_vector, &index_vector]
+            (int n, glm::vec3 a_vec, glm::vec3 b_vec, glm::vec3 face_vec) {
+                int base = int(coord_vector.size());
+                for (int a = 0; a <= n; ++a) {
+                    for (int b = 0; b <= n; ++b) {
+                        float a_coord = 2.0f * a / n - 1.0f;
+                        float b_coord = 2.0f * b / n - 1.0f;
+                        coord_vector.push_back(normalize(
+                            a_coord*a_vec + b_coord*b_vec + face_vec));
+                    }
+                }
+                for (int a = 0; a < n; ++a) {
+                    for (int b = 0; b < n; ++b) {
+                        int index0 = base + a*(n+1) + b;
+                        int index1 = index0 + (n+1);
+                        int index2 = index0 + 1;
+                        int index3 = index1 + 1;
+                        for (int index : { index0, index1, index3,
+                                           index0, index3, index2 }) {
+                            index_vector.push_back(GLushort(index));
+                        }
                     }
                 }
             };
             
-            add_face( {0,1,0}, {0,0,1}, {+magic,0,0} ); // +x face
-            add_face( {0,0,1}, {0,1,0}, {-magic,0,0} ); // -x face
-            add_face( {0,0,1}, {1,0,0}, {0,+magic,0} ); // +y face
-            add_face( {1,0,0}, {0,0,1}, {0,-magic,0} ); // -y face
-            add_face( {1,0,0}, {0,1,0}, {0,0,+magic} ); // +z face
-            add_face( {0,1,0}, {1,0,0}, {0,0,-magic} ); // -z face
-            
-            vertex_count = int(coord_vector.size());
+            for (int lod = 0; lod < sphere_lod_count; ++lod) {
+                int n = sphere_lod_divisions[lod];
+                lod_first_index[lod] = int(index_vector.size());
+                add_face(n, {0,1,0}, {0,0,1}, {+1,0,0} ); // +x face
+                add_face(n, {0,0,1}, {0,1,0}, {-1,0,0} ); // -x face
+                add_face(n, {0,0,1}, {1,0,0}, {0,+1,0} ); // +y face
+                add_face(n, {1,0,0}, {0,0,1}, {0,-1,0} ); // -y face
+                add_face(n, {1,0,0}, {0,1,0}, {0,0,+1} ); // +z face
+                add_face(n, {0,1,0}, {1,0,0}, {0,0,-1} ); // -z face
+                lod_index_count[lod] = int(index_vector.size()) - lod_first_index[lod];
+            }
+            assert(coord_vector.size() <= 65536);
             
             PANIC_IF_GL_ERROR;
             glGenBuffers(1, &vertex_buffer_id);
@@ -398,75 +3132,139 @@ class Ball {
                 coord_vector.data(),
                 GL_STATIC_DRAW
             );
+            glGenBuffers(1, &index_buffer_id);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_id);
+            glBufferData(
+                GL_ELEMENT_ARRAY_BUFFER,
+                sizeof(GLushort) * index_vector.size(),
+                index_vector.data(),
+                GL_STATIC_DRAW
+            );
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
             buffers_initialized = true;
         }
         
+        // Occlusion culling would leave gaps in the GPU physics
+        // segments, so it's only done with CPU physics.
+        occlusion_cull = occlusion_cull && !gpu_state_buffer;
+        static std::vector<DrawSegment> segments;
+        Instance* view_instances = static_cast<Instance*>(stream_buffer.map(
+            sizeof(Instance) * std::max(instance_count, 1), sizeof(Instance),
+            &instance_offset));
+        if (gpu_state_buffer) {
+            gpu_view_instances(skip, view_instances, &segments);
+        } else {
+            sort_view_instances(view_matrix, proj_matrix, skip, layered_target,
+                                occlusion_cull, view_instances, &segments);
+        }
+        // Views usually see a fraction of a big scene, so only keep
+        // the instances actually written.
+        int written = 1;
+        for (DrawSegment const& segment : segments) {
+            written = std::max(written, segment.first_instance + segment.count);
+        }
+        stream_buffer.unmap(sizeof(Instance) * written);
+        
+        int coarsest = sphere_lod_count - 1;
+        if (impostor_balls) {
+            draw_impostors(segments, layered_target);
+            if (occlusion_cull) {
+                issue_occlusion_queries(
+                    vertex_buffer_id, index_buffer_id,
+                    lod_first_index[coarsest], lod_index_count[coarsest]);
+            }
+            return;
+        }
+        
+        // Draw every segment with the currently bound program and vertex
+        // array, pointing the instance attributes at each one in turn.
+        auto draw_segments = [] (const char* stage_name) {
+            ProfileScope scope(stage_name);
+            for (DrawSegment const& segment : segments) {
+                if (segment.count == 0) continue;
+                bind_segment(segment);
+                glDrawElementsInstanced(
+                    GL_TRIANGLES, lod_index_count[segment.lod], GL_UNSIGNED_SHORT,
+                    (void*)(lod_first_index[segment.lod] * sizeof(GLushort)),
+                    segment.count
+                );
+            }
+        };
+        
+        // Each program comes in two variants: [0] draws to an ordinary
+        // framebuffer and [1] draws to all six faces of a layered
+        // framebuffer (see make_layered_program).
+        const int layered = layered_target != nullptr;
+        
         static bool initialized0 = false;
         static GLuint vao0;
-        static GLuint program0_id;
-        
-        static GLint view_matrix_idx0;
-        static GLint proj_matrix_idx0;
-        static GLint color_idx0;
-        static GLint sphere_origin_idx0;
-        static GLint radius_idx0;
-        static GLint reflection_cubemap_idx0;
-        static GLint eye_idx0;
+        static GLuint program0_id[2];
+        
+        static GLint radius_scale_idx0[2];
+        static GLint probe_array_idx0[2];
         static GLint sphere_coord_idx0 = 0;
         
         static const char vs0_source[] =
             "#version 330\n"
             "precision mediump float;\n"
-            "uniform mat4 view_matrix;\n"
-            "uniform mat4 proj_matrix;\n"
-            "uniform vec3 color;\n"
-            "uniform float radius;\n"
-            "uniform vec3 sphere_origin;\n"
-            "uniform vec3 eye;\n"
+            VIEW_BLOCK_GLSL
+            "uniform float radius_scale;\n"
             
             "layout(location=0) in vec3 sphere_coord;\n"
+            "layout(location=1) in vec3 sphere_origin;\n"
+            "layout(location=2) in float radius;\n"
+            "layout(location=3) in vec3 color;\n"
+            "layout(location=4) in float probe_slot;\n"
             
             "out vec3 surface_color;\n"
             "out vec3 reflected_vector;\n"
+            "flat out float slot;\n"
             "void main() {\n"
-                "vec4 coord = vec4(radius*sphere_coord + sphere_origin, 1.0);\n"
+                "vec4 coord = vec4(radius_scale*radius*sphere_coord + sphere_origin, 1.0);\n"
+            "#ifdef LAYERED\n"
+                "gl_Position = coord;\n"
+            "#else\n"
                 "gl_Position = proj_matrix * view_matrix * coord;\n"
+            "#endif\n"
                 "surface_color = color;\n"
                 "reflected_vector = reflect(coord.xyz - eye, sphere_coord);\n"
+                "slot = probe_slot;\n"
             "}\n"
         ;
         static const char fs0_source[] =
             "#version 330\n"
             "precision mediump float;\n"
-            "uniform samplerCube reflection_cubemap;\n"
+            "uniform sampler2DArray probe_array;\n"
             "in vec3 reflected_vector;\n"
             "in vec3 surface_color;\n"
+            "flat in float slot;\n"
             "layout(location=0) out vec4 fragment_color;\n"
+            SAMPLE_PROBE_GLSL
             "void main() { \n"
                 "vec3 c = 0.25*surface_color\n"
-                "       + 0.75*texture(reflection_cubemap,reflected_vector).rgb;\n"
+                "       + 0.75*sample_probe(probe_array,slot,reflected_vector).rgb;\n"
                 "fragment_color = vec4(c,1.0);\n"
             "}\n"
         ;
         if (!initialized0) {
             PANIC_IF_GL_ERROR;
-            program0_id = make_program(vs0_source, fs0_source);
+            program0_id[0] = make_program(vs0_source, fs0_source);
+            program0_id[1] = make_layered_program(vs0_source, fs0_source,
+                { {"vec3", "surface_color"}, {"vec3", "reflected_vector"},
+                  {"flat float", "slot"} });
             
             PANIC_IF_GL_ERROR;
             glGenVertexArrays(1, &vao0);
             glBindVertexArray(vao0);
             
-            view_matrix_idx0 = glGetUniformLocation(program0_id, "view_matrix");
-            proj_matrix_idx0 = glGetUniformLocation(program0_id, "proj_matrix");
-            color_idx0 = glGetUniformLocation(program0_id, "color");
-            sphere_origin_idx0 = glGetUniformLocation(program0_id, "sphere_origin");
-            radius_idx0 = glGetUniformLocation(program0_id, "radius");
-            eye_idx0 = glGetUniformLocation(program0_id, "eye");
-            reflection_cubemap_idx0 = glGetUniformLocation(
-                program0_id, "reflection_cubemap"
-            );
+            for (int i = 0; i < 2; ++i) {
+                GLuint id = program0_id[i];
+                radius_scale_idx0[i] = glGetUniformLocation(id, "radius_scale");
+                probe_array_idx0[i] = glGetUniformLocation(id, "probe_array");
+            }
             
             glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_id);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_id);
             
             glVertexAttribPointer(
                 sphere_coord_idx0,
@@ -477,95 +3275,86 @@ class Ball {
                 (void*)0
             );
             glEnableVertexAttribArray(sphere_coord_idx0);
+            bind_instance_attributes();
             PANIC_IF_GL_ERROR;
             
             initialized0 = true;
         }
         
-        glUseProgram(program0_id);
+        glUseProgram(program0_id[layered]);
         glBindVertexArray(vao0);
         
-        glUniformMatrix4fv(view_matrix_idx0, 1, false, &view_matrix[0][0]);
-        glUniformMatrix4fv(proj_matrix_idx0, 1, false, &proj_matrix[0][0]);
-        glm::vec3 eye = inverse(view_matrix) * glm::vec4(0,0,0,1);
-        glUniform3fv(eye_idx0, 1, &eye[0]);
+        glUniform1f(radius_scale_idx0[layered], ball_core_radius_ratio);
         
-        for (Ball const& ball : list) {
-            if (&ball == skip) continue;
-            
-            glUniform3f(color_idx0, ball.r, ball.g, ball.b);
-            glUniform3fv(sphere_origin_idx0, 1, &ball.position[0]);
-            glUniform1f(radius_idx0, ball.radius * ball_core_radius_ratio);
-            
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, ball.render.cubemap);
-            glUniform1i(reflection_cubemap_idx0, 0);
-            
-            glDrawArrays(GL_TRIANGLES, 0, vertex_count);
-        }
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, probe_array.color_texture);
+        glUniform1i(probe_array_idx0[layered], 0);
+        
+        draw_segments("balls core");
         
         static bool initialized2 = false;
         static GLuint vao2;
-        static GLuint program2_id;
-        
-        static GLint view_matrix_idx2;
-        static GLint proj_matrix_idx2;
-        static GLint sphere_origin_idx2;
-        static GLint radius_idx2;
-        static GLint eye_idx2;
-        static GLint refract_cubemap_idx2;
+        static GLuint program2_id[2];
+        
+        static GLint probe_array_idx2[2];
         static GLint sphere_coord_idx2 = 0;
         
         static const char vs2_source[] =
             "#version 330\n"
             "precision mediump float;\n"
-            "uniform mat4 view_matrix;\n"
-            "uniform mat4 proj_matrix;\n"
-            "uniform vec3 sphere_origin;\n"
-            "uniform float radius;\n"
-            "uniform vec3 eye;\n"
+            VIEW_BLOCK_GLSL
             
             "layout(location=0) in vec3 sphere_coord;\n"
+            "layout(location=1) in vec3 sphere_origin;\n"
+            "layout(location=2) in float radius;\n"
+            "layout(location=4) in float probe_slot;\n"
             "out vec3 refract_vector;\n"
+            "flat out float slot;\n"
             
             "void main() { \n"
                 "vec3 world_coord = radius*sphere_coord + sphere_origin;\n"
                 "vec3 incident = normalize(world_coord - eye);\n"
                 "vec3 normal = -sphere_coord;\n"
                 "refract_vector = refract(incident, normal, 0.64);\n"
+                "slot = probe_slot;\n"
+            "#ifdef LAYERED\n"
+                "gl_Position = vec4(world_coord, 1);\n"
+            "#else\n"
                 "gl_Position = proj_matrix*view_matrix*vec4(world_coord, 1);\n"
+            "#endif\n"
             "} \n"
         ;
         
         static const char fs2_source[] =
             "#version 330\n"
             "precision mediump float;\n"
-            "uniform samplerCube refract_cubemap;\n"
+            "uniform sampler2DArray probe_array;\n"
             
             "in vec3 refract_vector;\n"
+            "flat in float slot;\n"
             "out vec4 frag_color;\n"
             
+            SAMPLE_PROBE_GLSL
             "void main() { \n"
-                "frag_color = texture(refract_cubemap, refract_vector);\n"
+                "frag_color = sample_probe(probe_array, slot, refract_vector);\n"
             "} \n"
         ;
         
         if (!initialized2) {
             PANIC_IF_GL_ERROR;
-            program2_id = make_program(vs2_source, fs2_source);
+            program2_id[0] = make_program(vs2_source, fs2_source);
+            program2_id[1] = make_layered_program(vs2_source, fs2_source,
+                { {"vec3", "refract_vector"}, {"flat float", "slot"} });
             glGenVertexArrays(1, &vao2);
             glBindVertexArray(vao2);
             
-            view_matrix_idx2 = glGetUniformLocation(program2_id, "view_matrix");
-            proj_matrix_idx2 = glGetUniformLocation(program2_id, "proj_matrix");
-            sphere_origin_idx2 = glGetUniformLocation(
-                program2_id, "sphere_origin");
-            radius_idx2 = glGetUniformLocation(program2_id, "radius");
-            eye_idx2 = glGetUniformLocation(program2_id, "eye");
-            refract_cubemap_idx2 = glGetUniformLocation(
-                program2_id, "refract_cubemap");
+            for (int i = 0; i < 2; ++i) {
+                GLuint id = program2_id[i];
+                probe_array_idx2[i] = glGetUniformLocation(id, "probe_array");
+            }
             
             glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_id);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_id);
             glVertexAttribPointer(
                 sphere_coord_idx2,
                 3,
@@ -575,62 +3364,48 @@ class Ball {
                 (void*)0
             );
             glEnableVertexAttribArray(sphere_coord_idx2);
+            bind_instance_attributes();
             PANIC_IF_GL_ERROR;
             
             initialized2 = true;
         }
         
         glCullFace(GL_FRONT);
-        glUseProgram(program2_id);
+        glUseProgram(program2_id[layered]);
         glBindVertexArray(vao2);
         
-        glUniformMatrix4fv(view_matrix_idx2, 1, false, &view_matrix[0][0]);
-        glUniformMatrix4fv(proj_matrix_idx2, 1, false, &proj_matrix[0][0]);
-        glUniform3fv(eye_idx2, 1, &eye[0]);
-        PANIC_IF_GL_ERROR;
+        glUniform1i(probe_array_idx2[layered], 0);
+        DRAW_PANIC_IF_GL_ERROR;
         
-        for (Ball const& ball : list) {
-            if (&ball == skip) continue;
-            
-            glUniform3fv(sphere_origin_idx2, 1, &ball.position[0]);
-            glUniform1f(radius_idx2, ball.radius);
-            
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, ball.render.cubemap);
-            glUniform1i(refract_cubemap_idx2, 0);
-            
-            glDrawArrays(GL_TRIANGLES, 0, vertex_count);
-            PANIC_IF_GL_ERROR;
-        }
+        draw_segments("balls shell back");
+        DRAW_PANIC_IF_GL_ERROR;
         glCullFace(GL_BACK);
         
         static bool initialized1 = false;
         static GLuint vao1;
-        static GLuint program1_id;
+        static GLuint program1_id[2];
         
-        static GLint view_matrix_idx1;
-        static GLint proj_matrix_idx1;
-        static GLint sphere_origin_idx1;
-        static GLint radius_idx1;
-        static GLint eye_idx1;
         static GLint sphere_coord_idx1 = 0;
         
         static const char vs1_source[] =
             "#version 330\n"
             "precision mediump float;\n"
-            "uniform mat4 view_matrix;\n"
-            "uniform mat4 proj_matrix;\n"
-            "uniform vec3 sphere_origin;\n"
-            "uniform float radius;\n"
+            VIEW_BLOCK_GLSL
             
             "layout(location=0) in vec3 sphere_coord;\n"
+            "layout(location=1) in vec3 sphere_origin;\n"
+            "layout(location=2) in float radius;\n"
             "out vec3 varying_normal;\n"
             "out vec3 varying_pos;\n"
             
             "void main() { \n"
                 "vec3 coord3 = radius*sphere_coord + sphere_origin;\n"
                 "vec4 coord = vec4(coord3, 1.0);\n"
+            "#ifdef LAYERED\n"
+                "gl_Position = coord;\n"
+            "#else\n"
                 "gl_Position = proj_matrix * view_matrix * coord;\n"
+            "#endif\n"
                 "varying_normal = sphere_coord;\n"
                 "varying_pos = coord3;\n"
             "}\n"
@@ -641,8 +3416,7 @@ class Ball {
             "in vec3 varying_normal;\n"
             "in vec3 varying_pos;\n"
             "out vec4 frag_color;\n"
-            "uniform mat4 view_matrix;\n"
-            "uniform vec3 eye;\n"
+            VIEW_BLOCK_GLSL
             "void main() { \n"
                 "float Dot = dot(normalize(eye-varying_pos),\n"
                                 "normalize(varying_normal));\n"
@@ -653,20 +3427,16 @@ class Ball {
         
         if (!initialized1) {
             PANIC_IF_GL_ERROR;
-            program1_id = make_program(vs1_source, fs1_source);
+            program1_id[0] = make_program(vs1_source, fs1_source);
+            program1_id[1] = make_layered_program(vs1_source, fs1_source,
+                { {"vec3", "varying_normal"}, {"vec3", "varying_pos"} });
             
             PANIC_IF_GL_ERROR;
             glGenVertexArrays(1, &vao1);
             glBindVertexArray(vao1);
             
-            view_matrix_idx1 = glGetUniformLocation(program1_id, "view_matrix");
-            proj_matrix_idx1 = glGetUniformLocation(program1_id, "proj_matrix");
-            sphere_origin_idx1 = glGetUniformLocation(
-                program1_id, "sphere_origin");
-            radius_idx1 = glGetUniformLocation(program1_id, "radius");
-            eye_idx1 = glGetUniformLocation(program1_id, "eye");
-            
             glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_id);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_id);
             glVertexAttribPointer(
                 sphere_coord_idx1,
                 3,
@@ -676,128 +3446,1271 @@ class Ball {
                 (void*)0
             );
             glEnableVertexAttribArray(sphere_coord_idx1);
+            bind_instance_attributes();
             PANIC_IF_GL_ERROR;
             
             initialized1 = true;
         }
         
-        glUseProgram(program1_id);
+        glUseProgram(program1_id[layered]);
         glBindVertexArray(vao1);
         
-        glUniformMatrix4fv(view_matrix_idx1, 1, false, &view_matrix[0][0]);
-        glUniformMatrix4fv(proj_matrix_idx1, 1, false, &proj_matrix[0][0]);
-        glUniform3fv(eye_idx1, 1, &eye[0]);
         
         glDepthMask(GL_FALSE);
+        draw_segments("balls shell front");
+        glDepthMask(GL_TRUE);
+        glBindVertexArray(0);
+        
+        if (occlusion_cull) {
+            issue_occlusion_queries(
+                vertex_buffer_id, index_buffer_id,
+                lod_first_index[coarsest], lod_index_count[coarsest]);
+        }
+    }
+    
+    // Draw the scene from this ball's perspective onto the probe in
+    // slot (one of the ones ProbeScheduler keeps for the ball), either
+    // all six faces in one layered pass or one face at a time. With
+    // face_count < 6, only the faces first_face, first_face+1, ...
+    // (mod 6) are drawn, one at a time.
+    void update_reflection_texture(int slot, int first_face=0,
+                                   int face_count=6) const {
+        draw_probe(*list, position(), radius()*0.1f, slot,
+                   index, first_face, face_count);
+    }
+    
+    // Draw the scene as seen from center (with the given near plane
+    // distance) onto the probe in slot, leaving out ball skip of list.
+    // The faces drawn are chosen as for update_reflection_texture.
+    // Without draw_balls, only the skybox is drawn. The faces are drawn
+    // into the scratch faces and then blitted onto the probe (stretched,
+    // when the resolution_scaler shrinks them).
+    static void draw_probe(
+        BallList const& list, glm::vec3 center, float near_distance, int slot,
+        int skip=-1, int first_face=0, int face_count=6, bool draw_balls=true
+    ) {
+        ProfileScope scope("probe");
+        LayeredTarget target;
+        glm::mat4 proj_matrix = glm::perspective(
+            1.5707963267948966f, 1.0f, near_distance, far_plane
+        );
+        glm::vec3 v = center;
+        
+        for (int i = 0; i < 6; ++i) {
+            target.face_view_matrices[i] = glm::lookAt(
+                v, v+cubemap_face_forward[i], cubemap_face_up[i]
+            );
+        }
+        target.face_layer_base = 0;
+        
+        const int dim = resolution_scaler.probe_face_dim();
+        set_viewport(dim, dim);
+        
+        if (layered_probes && face_count >= 6) {
+            glBindFramebuffer(GL_FRAMEBUFFER, probe_array.layered_framebuffer);
+            draw_scene(target.face_view_matrices[plus_x_index], proj_matrix,
+                       list, skip, &target, false, draw_balls);
+            
+            ProfileScope blit_scope("probe blit");
+            for (int i = 0; i < 6; ++i) blit_scratch_face(slot, i, dim);
+            return;
+        }
+        
+        for (int n = 0; n < std::min(face_count, 6); ++n) {
+            int i = (first_face + n) % 6;
+            ProfileScope face_scope("probe face");
+            glBindFramebuffer(GL_FRAMEBUFFER, probe_array.scratch_framebuffers[i]);
+            draw_scene(target.face_view_matrices[i], proj_matrix, list, skip,
+                       nullptr, false, draw_balls);
+            blit_scratch_face(slot, i, dim);
+        }
+    }
+};
+
+// Chooses which probe each ball reflects and which probes to redraw
+// each frame, since redrawing all of them (6 scene renders per ball)
+// is the most expensive part of a frame.
+//
+// With reflection_lod, only balls at least probe_own_min_pixels in
+// radius on screen reflect their own probe. Smaller (or off screen)
+// balls borrow the probe of the nearest such ball within
+// probe_share_distance, or else reflect the scene probe, which is
+// drawn from the middle of the box every scene_probe_interval frames.
+// So the number of probes drawn depends on how many balls are big on
+// screen rather than on the number of balls.
+//
+// Up to probes_per_frame probes are redrawn (0 for no limit), and if
+// probe_budget_ms is set, only as many faces as fit in that much GPU
+// time, estimated from timer queries of past frames. Probes are
+// redrawn in order of priority:
+//
+//     screen size * (1 + distance moved / radius) * frames since redraw
+//
+// where screen size is radius / distance to the camera, so big, close,
+// fast and stale probes go first and every probe is redrawn eventually.
+// Probes that have never been drawn (or not since their ball last
+// started using its own probe) go before all others. With
+// stagger_probe_faces, each redraw only draws two of the six faces,
+// taking turns, so a probe is fully refreshed after three redraws.
+//
+// How many times light bounces between balls is set by
+// reflection_bounces:
+//
+// 0: balls reflect only the skybox. Every ball reflects the sky probe,
+//     which is drawn without balls every scene_probe_interval frames
+//     (the skybox is at infinity, so it looks the same from anywhere),
+//     and no other probe is drawn.
+// 1: probes show the balls, but the balls drawn into them reflect the
+//     sky probe.
+// 2: the balls drawn into a probe reflect the probes as they were at
+//     the end of the previous frame, so each redraw adds a bounce and
+//     inter-reflections deepen over a few frames.
+//
+// Either way, what a probe shows never depends on the order the
+// probes are redrawn in within a frame. For that, the scene probe and
+// every ball's own probe are double buffered: a redraw goes into the
+// probe's back slot (copying over the faces not redrawn when
+// staggering), and the balls only switch to reflecting it once all of
+// the frame's redraws are done.
+//
+// A ball's two slots are taken from the probe array when it gets its
+// own probe and given back when it loses it. At most max_own_probes()
+// balls, the biggest on screen, have their own probes; in big scenes
+// the rest share or reflect the scene probe.
+//
+// Probes are only redrawn when that would change them: when they have
+// never been drawn, when the settings they were drawn with (bounces,
+// impostors, face size, skybox) changed, or when a ball moved, relative
+// to the probe, by more than half a texel as seen from the probe since
+// it was last drawn. Once nothing changes, each probe is still redrawn
+// settle_redraws() more times so that the reflections of other probes
+// and staggered faces catch up. So while paused or with every ball at
+// rest, the probes soon stop being drawn at all.
+class ProbeScheduler {
+    // What a probe showed when it was last drawn. The positions are
+    // shared by every probe drawn in the same update.
+    struct Snapshot {
+        // Of every ball.
+        std::shared_ptr<std::vector<glm::vec3> const> positions;
+        glm::vec3 center;
+        double motion = 0.0; // total_motion when drawn.
+        uint32_t settings = 0;
+        int frame = -1; // Of the update that drew it, or -1 if never.
+        int clean_redraws = 0; // Since anything last changed.
+    };
+    
+    struct ProbeState {
+        glm::vec3 position;
+        int age = -1; // Frames since redrawn, or -1 if never drawn.
+        int next_face = 0;
+        bool own = false; // Whether the ball uses its own probe.
+        int slots[2] = { -1, -1 }; // Front and back, while own.
+        Snapshot seen;
+        bool changed = false; // This frame, since seen.
+    };
+    std::vector<ProbeState> probes;
+    std::vector<int> slots;
+    // For each ball, the ball whose probe it reflects, or scene_source
+    // or sky_source.
+    std::vector<int> sources;
+    std::vector<int> own_balls;
+    std::vector<std::pair<float, int>> candidates, order;
+    std::vector<int> sky_slots;
+    glm::vec3 eye;
+    
+    static constexpr int scene_source = -1, sky_source = -2;
+    int scene_probe_slots[2] = { -1, -1 }; // Front, back.
+    int scene_probe_age = -1;
+    bool scene_probe_used = false;
+    Snapshot scene_probe_seen;
+    int sky_probe_slot = -1;
+    bool sky_probe_drawn = false;
+    uint32_t sky_probe_settings = 0; // settings() when last drawn.
+    
+    // The balls' positions as of the last update, also binned into grid
+    // (which is only built when changed() needs it).
+    std::vector<float> ball_x, ball_y, ball_z;
+    UniformGrid grid;
+    int grid_frame = -1;
+    // Sum over the updates of the farthest any ball moved in each, so no
+    // ball moved farther than the difference between two updates'.
+    double total_motion = 0.0;
+    // The positions the probes drawn this update share, once one is.
+    std::shared_ptr<std::vector<glm::vec3> const> frame_positions;
+    
+    // Ring of timer queries around each frame's probe updates.
+    static constexpr int query_count = 3;
+    GLuint queries[query_count] = { 0 };
+    int query_faces[query_count] = { 0 };
+    int frame = 0;
+    float ms_per_face = 0.0f; // Running average, 0 until measured.
+    
+    void read_timer_query(int q) {
+        GLint available = 0;
+        if (query_faces[q] == 0) return;
+        glGetQueryObjectiv(queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) return;
+        
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(queries[q], GL_QUERY_RESULT, &ns);
+        float sample = ns * 1e-6f / query_faces[q];
+        ms_per_face = ms_per_face == 0.0f ? sample
+                                          : 0.9f * ms_per_face + 0.1f * sample;
+        query_faces[q] = 0;
+    }
+    
+    // The slot the balls reflect for a source.
+    int source_slot(int source) const {
+        if (source == sky_source) return sky_probe_slot;
+        if (source == scene_source) return scene_probe_slots[0];
+        return probes[source].slots[0];
+    }
+    
+    // How many balls can have their own probes, two slots each: what's
+    // left of max_probe_slots() after the sky probe's one slot and the
+    // scene probe's two.
+    static int max_own_probes() {
+        return (max_probe_slots() - 3) / 2;
+    }
+    
+    // Give ball i its own probe, or take it away.
+    void set_own(int i, bool own) {
+        ProbeState& probe = probes[i];
+        if (own == probe.own) return;
+        probe.own = own;
+        for (int& slot : probe.slots) {
+            if (own) {
+                slot = new_probe_slot();
+            } else {
+                free_probe_slot(slot);
+                slot = -1;
+            }
+        }
+        probe.age = -1;
+        probe.next_face = 0;
+        probe.seen = Snapshot();
+    }
+    
+    // What else than the balls' positions the probes' pictures depend on.
+    static uint32_t settings() {
+        uint32_t hash = 2166136261u;
+        for (int value : { reflection_bounces, int(impostor_balls),
+                           resolution_scaler.probe_face_dim(),
+                           skybox_generation }) {
+            hash = (hash ^ uint32_t(value)) * 16777619u;
+        }
+        return hash;
+    }
+    
+    static int settle_redraws() {
+        return (reflection_bounces >= 2 ? 2 : 0) + (stagger_probe_faces ? 2 : 0);
+    }
+    
+    // Whether a probe now at center would look different from what it
+    // showed when it drew seen.
+    bool changed(Snapshot const& seen, BallList const& list, glm::vec3 center) {
+        if (seen.frame < 0 || seen.settings != settings()
+            || int(seen.positions->size()) != list.size()) {
+            return true;
+        }
+        // No ball moved farther than bound relative to the probe, so
+        // only balls that were within bound / max_angle of it can have
+        // moved by more than max_angle as seen from it; those are now
+        // within reach of center.
+        float bound = float(total_motion - seen.motion)
+                    + glm::length(center - seen.center);
+        if (bound == 0.0f) return false;
+        float max_angle = 0.7853982f / resolution_scaler.probe_face_dim();
+        float reach = bound / max_angle + bound;
+        
+        if (grid_frame != frame) {
+            grid.build(list.size(), ball_x.data(), ball_y.data(), ball_z.data(),
+                       0.0f);
+            grid_frame = frame;
+        }
+        return grid.visit_near(center, reach, [&] (int j) {
+            glm::vec3 then = (*seen.positions)[j] - seen.center;
+            glm::vec3 now = list[j].position() - center;
+            float distance = std::max(glm::length(then), list[j].radius());
+            return glm::length(now - then) > max_angle * distance;
+        });
+    }
+    
+    // Record that a probe at center was drawn this frame.
+    void record(Snapshot* seen, BallList const& list, glm::vec3 center,
+                bool was_changed) {
+        seen->clean_redraws = was_changed ? 0 : seen->clean_redraws + 1;
+        if (!frame_positions) {
+            auto positions = std::make_shared<std::vector<glm::vec3>>();
+            positions->reserve(list.size());
+            for (int j = 0; j < list.size(); ++j) {
+                positions->push_back(list[j].position());
+            }
+            frame_positions = positions;
+        }
+        seen->positions = frame_positions;
+        seen->motion = total_motion;
+        seen->center = center;
+        seen->settings = settings();
+        seen->frame = frame;
+    }
+    
+    void free_own_probes() {
+        for (int i = 0; i < int(probes.size()); ++i) set_own(i, false);
+    }
+    
+  public:
+    ProbeScheduler() = default;
+    ProbeScheduler(ProbeScheduler const&) = delete;
+    
+    ~ProbeScheduler() {
+        if (queries[0] != 0) glDeleteQueries(query_count, queries);
+        for (int slot : scene_probe_slots) {
+            if (slot >= 0) free_probe_slot(slot);
+        }
+        if (sky_probe_slot >= 0) free_probe_slot(sky_probe_slot);
+        free_own_probes();
+    }
+    
+    // Choose the probe slot each ball of list reflects this frame, as
+    // seen by a camera with the given view and projection matrices.
+    // Call once per frame before upload_instances, passing it
+    // probe_slots().
+    void assign_probes(BallList const& list,
+                       glm::mat4 view_matrix, glm::mat4 proj_matrix) {
+        if (int(probes.size()) != list.size()) {
+            free_own_probes();
+            probes.assign(list.size(), ProbeState());
+        }
+        eye = glm::vec3(glm::inverse(view_matrix)[3]);
+        slots.resize(list.size());
+        sources.resize(list.size());
+        own_balls.clear();
+        scene_probe_used = false;
         
-        for (Ball const& ball : list) {
-            if (&ball == skip) continue;
+        if (reflection_bounces <= 0) {
+            free_own_probes();
+            if (sky_probe_slot < 0) sky_probe_slot = new_probe_slot();
+            sources.assign(list.size(), sky_source);
+            slots.assign(list.size(), sky_probe_slot);
+            return;
+        }
+        
+        candidates.clear();
+        for (int i = 0; i < list.size(); ++i) {
+            float radius = list[i].radius();
+            glm::vec4 center = view_matrix * glm::vec4(list[i].position(), 1);
+            float distance = std::max(radius, glm::length(glm::vec3(center)));
+            float pixels = center.z > radius ? 0.0f
+                : radius / distance * proj_matrix[1][1] * 0.5f * screen_y;
             
-            glUniform3fv(sphere_origin_idx1, 1, &ball.position[0]);
-            glUniform1f(radius_idx1, ball.radius);
+            sources[i] = scene_source;
+            if (!reflection_lod || pixels >= probe_own_min_pixels) {
+                candidates.emplace_back(-pixels, i);
+            }
+        }
+        int own_limit = max_own_probes();
+        if (int(candidates.size()) > own_limit) {
+            std::nth_element(candidates.begin(), candidates.begin() + own_limit,
+                             candidates.end());
+            candidates.resize(own_limit);
+        }
+        for (auto const& candidate : candidates) {
+            sources[candidate.second] = candidate.second;
+        }
+        // Free the slots of the balls losing their probes before
+        // taking any for the balls getting one.
+        for (int i = 0; i < list.size(); ++i) {
+            if (sources[i] != i) set_own(i, false);
+        }
+        for (int i = 0; i < list.size(); ++i) {
+            if (sources[i] != i) continue;
+            set_own(i, true);
+            own_balls.push_back(i);
+        }
+        
+        for (int i = 0; i < list.size(); ++i) {
+            if (probes[i].own) continue;
+            float best = probe_share_distance;
+            int nearest = -1;
+            for (int j : own_balls) {
+                float d = glm::length(list[i].position() - list[j].position());
+                if (d < best) {
+                    best = d;
+                    nearest = j;
+                }
+            }
+            if (nearest >= 0) {
+                sources[i] = nearest;
+                continue;
+            }
+            for (int& slot : scene_probe_slots) {
+                if (slot < 0) slot = new_probe_slot();
+            }
+            sources[i] = scene_source;
+            scene_probe_used = true;
+        }
+        
+        for (int i = 0; i < list.size(); ++i) {
+            slots[i] = source_slot(sources[i]);
+        }
+    }
+    
+    int const* probe_slots() const {
+        return slots.data();
+    }
+    
+    // Redraw this frame's share of the probes chosen by the last
+    // assign_probes call for the balls in list, then point the balls
+    // at the new probes (Ball::set_probe_slots). Call once per frame
+    // after upload_instances.
+    void update(BallList const& list) {
+        if (queries[0] == 0) glGenQueries(query_count, queries);
+        int q = frame++ % query_count;
+        read_timer_query(q);
+        
+        // The motion bound only holds for the same balls, so a change
+        // in how many there are redraws every probe.
+        if (int(ball_x.size()) != list.size()) {
+            for (ProbeState& probe : probes) probe.seen = Snapshot();
+            scene_probe_seen = Snapshot();
+        }
+        ball_x.resize(list.size());
+        ball_y.resize(list.size());
+        ball_z.resize(list.size());
+        float max_motion = 0.0f;
+        for (int i = 0; i < list.size(); ++i) {
+            glm::vec3 position = list[i].position();
+            glm::vec3 previous(ball_x[i], ball_y[i], ball_z[i]);
+            max_motion = std::max(max_motion, glm::length(position - previous));
+            ball_x[i] = position.x;
+            ball_y[i] = position.y;
+            ball_z[i] = position.z;
+        }
+        total_motion += max_motion;
+        frame_positions.reset();
+        
+        order.clear();
+        for (int i : own_balls) {
+            ProbeState& probe = probes[i];
+            if (probe.age >= 0) ++probe.age;
+            probe.changed = changed(probe.seen, list, list[i].position());
+            if (!probe.changed && probe.seen.clean_redraws >= settle_redraws()) {
+                continue;
+            }
+            float priority = 3.4e38f;
+            if (probe.age >= 0) {
+                glm::vec3 position = list[i].position();
+                float radius = list[i].radius();
+                float screen_size = radius /
+                    std::max(radius, glm::length(position - eye));
+                float moved = glm::length(position - probe.position) / radius;
+                priority = screen_size * (1.0f + moved) * probe.age;
+            }
+            order.emplace_back(-priority, i);
+        }
+        std::sort(order.begin(), order.end());
+        
+        int faces_per_update = stagger_probe_faces ? 2 : 6;
+        int face_limit = 6 * list.size() + 6;
+        if (probe_budget_ms > 0.0f && ms_per_face > 0.0f) {
+            face_limit = int(probe_budget_ms / ms_per_face);
+        }
+        
+        glBeginQuery(GL_TIME_ELAPSED, queries[q]);
+        int updates = 0, faces = 0;
+        glm::vec3 box_center(
+            0.5f * (min_x + max_x), 0.5f * (min_y + max_y),
+            0.5f * (min_z + max_z));
+        if (reflection_bounces <= 1) {
+            if (sky_probe_slot < 0) sky_probe_slot = new_probe_slot();
+            if (!sky_probe_drawn || sky_probe_settings != settings()) {
+                Ball::draw_probe(list, box_center, near_plane, sky_probe_slot,
+                                 -1, 0, 6, false);
+                sky_probe_drawn = true;
+                sky_probe_settings = settings();
+                faces += 6;
+            }
+        }
+        if (reflection_bounces == 1) {
+            sky_slots.assign(list.size(), sky_probe_slot);
+            Ball::set_probe_slots(sky_slots.data());
+        }
+        
+        if (scene_probe_used) {
+            if (scene_probe_age >= 0) ++scene_probe_age;
+            bool scene_changed = changed(scene_probe_seen, list, box_center);
+            bool dirty = scene_changed
+                || scene_probe_seen.clean_redraws < settle_redraws();
+            if (scene_probe_age < 0
+                || (dirty && scene_probe_age >= scene_probe_interval)) {
+                Ball::draw_probe(list, box_center, near_plane,
+                                 scene_probe_slots[1]);
+                swap(scene_probe_slots[0], scene_probe_slots[1]);
+                record(&scene_probe_seen, list, box_center, scene_changed);
+                scene_probe_age = 0;
+                faces += 6;
+            }
+        }
+        for (auto const& entry : order) {
+            if (probes_per_frame > 0 && updates >= probes_per_frame) break;
+            if (faces > 0 && faces + faces_per_update > face_limit) break;
             
-            glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+            int i = entry.second;
+            ProbeState& probe = probes[i];
+            int front = probe.slots[0], back = probe.slots[1];
+            if (faces_per_update < 6 && probe.age >= 0) {
+                copy_probe_faces(front, back, probe.next_face + faces_per_update,
+                                 6 - faces_per_update);
+            }
+            list[i].update_reflection_texture(
+                back, probe.next_face, faces_per_update);
+            swap(probe.slots[0], probe.slots[1]);
+            record(&probe.seen, list, list[i].position(), probe.changed);
+            probe.next_face = (probe.next_face + faces_per_update) % 6;
+            probe.position = list[i].position();
+            probe.age = 0;
+            ++updates;
+            faces += faces_per_update;
+        }
+        glEndQuery(GL_TIME_ELAPSED);
+        query_faces[q] = faces;
+        
+        for (int i = 0; i < list.size(); ++i) {
+            slots[i] = source_slot(sources[i]);
+        }
+        Ball::set_probe_slots(slots.data());
+    }
+};
+
+void BallList::emplace_back(
+    glm::vec3 pos_arg, glm::vec3 vel_arg,
+    float r_arg, float g_arg, float b_arg, float radius_arg
+) {
+    physics.add(pos_arg, vel_arg, radius_arg);
+    color.emplace_back(r_arg, g_arg, b_arg);
+}
+
+void BallList::clear() {
+    physics.clear();
+    color.clear();
+}
+
+Ball BallList::operator[](int i) const {
+    return Ball(this, i);
+}
+
+GLintptr Ball::instance_offset = 0;
+GLuint Ball::gpu_state_buffer = 0;
+std::vector<Ball::Instance> Ball::instances;
+int Ball::instance_count = 0;
+std::vector<Ball::OcclusionQuery> Ball::occlusion_queries;
+
+// A whole file mapped read-only into memory (read into memory where
+// there's no mmap). data() is null if the file couldn't be opened.
+class MappedFile {
+  public:
+    explicit MappedFile(std::string const& path) {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* mapping = mmap(nullptr, size_t(info.st_size), PROT_READ,
+                                 MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                bytes = static_cast<uint8_t const*>(mapping);
+                byte_count = size_t(info.st_size);
+            }
+        }
+        close(fd);
+#else
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == nullptr) return;
+        uint8_t chunk[65536];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof chunk, file)) > 0) {
+            buffer.insert(buffer.end(), chunk, chunk + n);
+        }
+        fclose(file);
+        bytes = buffer.data();
+        byte_count = buffer.size();
+#endif
+    }
+    
+    ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (bytes) munmap(const_cast<uint8_t*>(bytes), byte_count);
+#endif
+    }
+    
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+    
+    uint8_t const* data() const { return bytes; }
+    size_t size() const { return byte_count; }
+    
+  private:
+    uint8_t const* bytes = nullptr;
+    size_t byte_count = 0;
+#if !(defined(__unix__) || defined(__APPLE__))
+    std::vector<uint8_t> buffer;
+#endif
+};
+
+// Scene files, for --scene, --write-scene and the F5 / F9 quick save,
+// hold the box, the gravity and the full state of every ball: a
+// SceneHeader, then ball_count SceneBalls. Everything is in native byte
+// order and naturally aligned, so a MappedFile is read in place.
+struct SceneHeader {
+    char magic[4]; // scene_magic
+    uint32_t ball_count;
+    float box_min[3], box_max[3];
+    float gravity;
+    uint32_t unused;
+};
+
+struct SceneBall {
+    float position[3];
+    float velocity[3];
+    float radius;
+    uint8_t color[4]; // RGB and an unused byte.
+};
+
+static_assert(sizeof(SceneHeader) == 40 && sizeof(SceneBall) == 32,
+              "Scene file records are packed");
+
+const char scene_magic[4] = { 'B', 'S', 'C', '1' };
+
+// The header of the scene in the size bytes at data (the contents of
+// a scene file), or null (with *error set) if they aren't a scene.
+static SceneHeader const* scene_header(
+    uint8_t const* data, size_t size, std::string* error
+) {
+    auto header = reinterpret_cast<SceneHeader const*>(data);
+    if (header == nullptr) {
+        *error = "could not open file";
+    } else if (size < sizeof(SceneHeader)
+               || memcmp(header->magic, scene_magic, 4) != 0) {
+        *error = "not a scene file";
+    } else if (header->ball_count == 0) {
+        *error = "no balls";
+    } else if ((size - sizeof(SceneHeader)) / sizeof(SceneBall)
+               < header->ball_count) {
+        *error = "truncated";
+    } else if (!(header->box_min[0] < header->box_max[0]
+                 && header->box_min[1] < header->box_max[1]
+                 && header->box_min[2] < header->box_max[2])) {
+        *error = "empty box";
+    } else {
+        return header;
+    }
+    return nullptr;
+}
+
+// Replace the balls of *list, the box and the gravity with those of
+// a scene that scene_header accepted. Only call this while no physics
+// is running.
+static void load_scene(SceneHeader const* header, BallList* list) {
+    min_x = header->box_min[0];
+    min_y = header->box_min[1];
+    min_z = header->box_min[2];
+    max_x = header->box_max[0];
+    max_y = header->box_max[1];
+    max_z = header->box_max[2];
+    gravity = header->gravity;
+    
+    auto balls = reinterpret_cast<SceneBall const*>(header + 1);
+    list->clear();
+    for (uint32_t i = 0; i < header->ball_count; ++i) {
+        SceneBall const& ball = balls[i];
+        list->emplace_back(
+            glm::vec3(ball.position[0], ball.position[1], ball.position[2]),
+            glm::vec3(ball.velocity[0], ball.velocity[1], ball.velocity[2]),
+            ball.color[0] / 255.0f, ball.color[1] / 255.0f,
+            ball.color[2] / 255.0f, ball.radius);
+    }
+    ball_count = list->size();
+}
+
+// Set *out to the contents of a scene file holding the box, the
+// gravity and the balls of list: their colors, and the positions,
+// velocities and radii in state, which may be newer than list.physics.
+static void encode_scene(BallList const& list, BallPhysics const& state,
+                         std::vector<uint8_t>* out) {
+    assert(state.size() == list.size());
+    SceneHeader header = {};
+    memcpy(header.magic, scene_magic, 4);
+    header.ball_count = uint32_t(state.size());
+    header.box_min[0] = min_x;
+    header.box_min[1] = min_y;
+    header.box_min[2] = min_z;
+    header.box_max[0] = max_x;
+    header.box_max[1] = max_y;
+    header.box_max[2] = max_z;
+    header.gravity = gravity;
+    
+    std::vector<SceneBall> balls(state.size());
+    for (int i = 0; i < state.size(); ++i) {
+        SceneBall& ball = balls[i];
+        ball.position[0] = state.x[i];
+        ball.position[1] = state.y[i];
+        ball.position[2] = state.z[i];
+        ball.velocity[0] = state.vx[i];
+        ball.velocity[1] = state.vy[i];
+        ball.velocity[2] = state.vz[i];
+        ball.radius = state.radius[i];
+        for (int c = 0; c < 3; ++c) {
+            float value = std::min(1.0f, std::max(0.0f, list.color[i][c]));
+            ball.color[c] = uint8_t(value * 255.0f + 0.5f);
+        }
+        ball.color[3] = 0;
+    }
+    
+    auto header_bytes = reinterpret_cast<uint8_t const*>(&header);
+    auto ball_bytes = reinterpret_cast<uint8_t const*>(balls.data());
+    out->assign(header_bytes, header_bytes + sizeof header);
+    out->insert(out->end(), ball_bytes,
+                ball_bytes + sizeof(SceneBall) * balls.size());
+}
+
+// Write a scene file (see encode_scene) to path. Returns whether that
+// worked.
+static bool write_scene(std::string const& path, BallList const& list,
+                        BallPhysics const& state) {
+    std::vector<uint8_t> bytes;
+    encode_scene(list, state, &bytes);
+    std::string temp_path = path + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    bool okay = file != nullptr
+        && fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    if (file != nullptr && fclose(file) != 0) okay = false;
+    if (okay && rename(temp_path.c_str(), path.c_str()) == 0) return true;
+    remove(temp_path.c_str());
+    return false;
+}
+
+// Plays back a recording file (see RecordingHeader) in place of the
+// physics, for --replay: each advance() moves the balls to their state
+// after the next recorded step, going back to the start after the
+// last one.
+class Replay {
+  public:
+    explicit Replay(std::string const& path_arg) : path(path_arg), file(path_arg) {
+        std::string error = index();
+        if (!error.empty()) {
+            panic("Could not read recording", (path + ": " + error).c_str());
+        }
+    }
+    
+    // The scene the recording starts from.
+    SceneHeader const* scene() const {
+        return scene_start;
+    }
+    
+    int step_count() const {
+        return int(record_offsets.size());
+    }
+    
+    // Make the next advance() go to the state after step (wrapped to
+    // the recorded steps), decoding from the keyframe before it.
+    void seek(int step) {
+        step %= step_count();
+        for (int s = step - step % int(header->keyframe_interval); s < step; ++s) {
+            decode(s);
+        }
+        next_step = step;
+    }
+    
+    // Set the positions and velocities of *out, which must hold the
+    // recording's balls, to those after the next step.
+    void advance(BallPhysics* out) {
+        assert(out->size() == ball_count);
+        decode(next_step);
+        next_step = (next_step + 1) % step_count();
+        std::vector<float>* fields[6] = {
+            &out->x, &out->y, &out->z, &out->vx, &out->vy, &out->vz
+        };
+        for (int field = 0; field < 6; ++field) {
+            float quantum = field < 3 ? header->position_quantum
+                                      : header->velocity_quantum;
+            int32_t const* values = &current[field * ball_count];
+            float* out_values = fields[field]->data();
+            for (int i = 0; i < ball_count; ++i) {
+                out_values[i] = values[i] * quantum;
+            }
+        }
+    }
+    
+  private:
+    std::string path;
+    MappedFile file;
+    RecordingHeader const* header = nullptr;
+    SceneHeader const* scene_start = nullptr;
+    int ball_count = 0;
+    std::vector<size_t> record_offsets; // Of each step's byte count.
+    std::vector<int32_t> current;       // The quantized state after a step.
+    int next_step = 0;
+    
+    // Check the file and find its records. Returns what's wrong with
+    // it, or an empty string. A record cut short (by the recording
+    // being stopped, say) is ignored.
+    std::string index() {
+        uint8_t const* data = file.data();
+        size_t size = file.size();
+        if (data == nullptr) return "could not open file";
+        header = reinterpret_cast<RecordingHeader const*>(data);
+        if (size < sizeof(RecordingHeader)
+            || memcmp(header->magic, recording_magic, 4) != 0) {
+            return "not a recording";
+        }
+        std::string error;
+        scene_start = scene_header(data + sizeof(RecordingHeader),
+                                   size - sizeof(RecordingHeader), &error);
+        if (scene_start == nullptr) return error;
+        if (scene_start->ball_count != header->ball_count
+            || header->keyframe_interval == 0) {
+            return "bad header";
+        }
+        ball_count = int(header->ball_count);
+        
+        size_t offset = sizeof(RecordingHeader) + sizeof(SceneHeader)
+                      + sizeof(SceneBall) * size_t(ball_count);
+        while (size - offset >= 4) {
+            uint32_t record_size = 0;
+            memcpy(&record_size, data + offset, 4);
+            if (size - offset - 4 < record_size) break;
+            record_offsets.push_back(offset);
+            offset += 4 + size_t(record_size);
+        }
+        if (record_offsets.empty()) return "no steps recorded";
+        current.assign(6 * size_t(ball_count), 0);
+        return "";
+    }
+    
+    // Apply the record of step to current.
+    void decode(int step) {
+        uint32_t record_size = 0;
+        memcpy(&record_size, file.data() + record_offsets[step], 4);
+        uint8_t const* p = file.data() + record_offsets[step] + 4;
+        uint8_t const* end = p + record_size;
+        bool keyframe = step % int(header->keyframe_interval) == 0;
+        for (int32_t& value : current) {
+            int32_t delta = 0;
+            if (!get_varint(&p, end, &delta)) {
+                panic("Corrupt recording", path.c_str());
+            }
+            value = keyframe ? delta : value + delta;
+        }
+    }
+};
+
+// The six faces of a cubemap with all their mip levels, in memory.
+// images[level * 6 + face] is one image, with faces in
+// cubemap_face_enums order. If format is 0 the images are tightly
+// packed BGR bytes, otherwise they're in that GL compressed format.
+struct CubemapImages {
+    GLenum format = 0;
+    int size = 0; // Width and height of level 0.
+    int level_count = 0;
+    std::vector<std::vector<uint8_t>> images;
+};
+
+// The prebuilt skybox of an environment directory: the six cubemap
+// faces with all their mip levels, already in a GPU compressed format,
+// so that loading it is a mapped read and one glCompressedTexImage2D
+// per level and face, with no BMP decoding or mip generation. The file
+// is, in native byte order:
+//
+//     char     magic[4]           "BCUB"
+//     uint32_t internal_format    a GL compressed format
+//     uint32_t size               width and height of level 0
+//     uint32_t level_count
+//     then for each level, for each face in cubemap_face_enums order:
+//     uint32_t byte_count, followed by byte_count bytes of image data
+//
+// Build it with --write-skybox.
+const char skybox_container_name[] = "skybox.bcube";
+const char skybox_container_magic[4] = { 'B', 'C', 'U', 'B' };
+
+// The BMP of each face, in cubemap_face_enums order.
+const char* const skybox_face_filenames[6] = {
+    "right.bmp", "left.bmp", "top.bmp", "bottom.bmp", "front.bmp", "back.bmp",
+};
+
+static void set_cubemap_parameters(int max_level) {
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_LOD, 0);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LOD, max_level);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, max_level);
+}
+
+// The compressed texture formats the driver supports.
+static std::vector<GLint> supported_compressed_formats() {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &count);
+    std::vector<GLint> formats(count);
+    if (count > 0) glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, formats.data());
+    return formats;
+}
+
+// Read the skybox container at filename into *out. Returns false and
+// sets *error if it can't, leaving *error empty if there just is no
+// such file. Doesn't use OpenGL, so it can run on any thread.
+static bool read_skybox_container(
+    std::string const& filename, CubemapImages* out, std::string* error
+) {
+    error->clear();
+    MappedFile file(filename);
+    if (file.data() == nullptr) return false;
+    
+    size_t offset = 4;
+    auto read_u32 = [&file, &offset] (uint32_t* value) {
+        if (file.size() - offset < sizeof *value) return false;
+        memcpy(value, file.data() + offset, sizeof *value);
+        offset += sizeof *value;
+        return true;
+    };
+    
+    uint32_t header[3];
+    if (file.size() < 4 || memcmp(file.data(), skybox_container_magic, 4) != 0
+        || !read_u32(&header[0]) || !read_u32(&header[1]) || !read_u32(&header[2])
+        || header[1] < 1 || header[2] < 1 || header[2] > 32
+        || (header[1] >> (header[2] - 1)) < 1) {
+        *error = "Bad skybox container " + filename;
+        return false;
+    }
+    out->format = header[0];
+    out->size = int(header[1]);
+    out->level_count = int(header[2]);
+    out->images.resize(out->level_count * 6);
+    for (auto& image : out->images) {
+        uint32_t byte_count;
+        if (!read_u32(&byte_count) || file.size() - offset < byte_count) {
+            *error = "Truncated skybox container " + filename;
+            return false;
         }
-        glDepthMask(GL_TRUE);
-        glBindVertexArray(0);
+        image.assign(file.data() + offset, file.data() + offset + byte_count);
+        offset += byte_count;
     }
-    
-    void update_reflection_texture(BallList const& list) {
-        glm::mat4 view_matrix;
-        glm::mat4 proj_matrix = glm::perspective(
-            1.5707963267948966f, 1.0f, radius*0.1f, far_plane
-        );
-        glm::vec3 const& v = position;
-        
-        glViewport(0, 0, ball_cubemap_dim, ball_cubemap_dim);
-        
-        glBindFramebuffer(GL_FRAMEBUFFER, render.framebuffers[plus_x_index]);
-        view_matrix = glm::lookAt(v, v+glm::vec3(1,0,0), glm::vec3(0,-1,0));
-        draw_scene(view_matrix, proj_matrix, list, this);
-        
-        glBindFramebuffer(GL_FRAMEBUFFER, render.framebuffers[minus_x_index]);
-        view_matrix = glm::lookAt(v, v+glm::vec3(-1,0,0), glm::vec3(0,-1,0));
-        draw_scene(view_matrix, proj_matrix, list, this);
-        
-        glBindFramebuffer(GL_FRAMEBUFFER, render.framebuffers[plus_y_index]);
-            view_matrix = glm::lookAt(v, v+glm::vec3(0,1,0), glm::vec3(0,0,1));
-        draw_scene(view_matrix, proj_matrix, list, this);
+    return true;
+}
+
+// Read the six BMPs in directory into *out, and make the mip levels
+// with a box filter. The faces must be square, the same size and a
+// power of two wide. Returns false and sets *error if that fails.
+// Doesn't use OpenGL, so it can run on any thread.
+static bool read_bmp_cubemap(
+    std::string const& directory, CubemapImages* out, std::string* error
+) {
+    out->format = 0;
+    out->size = 0;
+    for (int face = 0; face < 6; ++face) {
+        std::string filename = directory + skybox_face_filenames[face];
+        SDL_Surface* loaded = SDL_LoadBMP(filename.c_str());
+        if (loaded == nullptr) {
+            *error = filename + ": " + SDL_GetError();
+            return false;
+        }
+        SDL_Surface* surface = SDL_ConvertSurfaceFormat(
+            loaded, SDL_PIXELFORMAT_BGR24, 0);
+        SDL_FreeSurface(loaded);
+        if (surface == nullptr) {
+            *error = filename + ": " + SDL_GetError();
+            return false;
+        }
         
-        glBindFramebuffer(GL_FRAMEBUFFER, render.framebuffers[minus_y_index]);
-        view_matrix = glm::lookAt(v, v+glm::vec3(0,-1,0), glm::vec3(0,0,-1));
-        draw_scene(view_matrix, proj_matrix, list, this);
+        int size = surface->w;
+        bool power_of_two = size > 0 && (size & (size - 1)) == 0;
+        if (face == 0 && power_of_two && surface->h == size) {
+            out->size = size;
+            out->level_count = 1;
+            while ((size >> out->level_count) >= 1) ++out->level_count;
+            out->images.assign(out->level_count * 6, std::vector<uint8_t>());
+        } else if (size != out->size || surface->h != size) {
+            *error = filename + ": faces must be square, the same size "
+                     "and a power of two wide";
+            SDL_FreeSurface(surface);
+            return false;
+        }
         
-        glBindFramebuffer(GL_FRAMEBUFFER, render.framebuffers[plus_z_index]);
-        view_matrix = glm::lookAt(v, v+glm::vec3(0,0,1), glm::vec3(0,-1,0));
-        draw_scene(view_matrix, proj_matrix, list, this);
+        std::vector<uint8_t>& image = out->images[face];
+        image.resize(size_t(size) * size * 3);
+        for (int y = 0; y < size; ++y) {
+            memcpy(&image[size_t(y) * size * 3],
+                   static_cast<uint8_t const*>(surface->pixels) + y * surface->pitch,
+                   size_t(size) * 3);
+        }
+        SDL_FreeSurface(surface);
         
-        glBindFramebuffer(GL_FRAMEBUFFER, render.framebuffers[minus_z_index]);
-        view_matrix = glm::lookAt(v, v+glm::vec3(0,0,-1), glm::vec3(0,-1,0));
-        draw_scene(view_matrix, proj_matrix, list, this);
+        for (int level = 1; level < out->level_count; ++level) {
+            std::vector<uint8_t> const& larger = out->images[(level - 1) * 6 + face];
+            std::vector<uint8_t>& smaller = out->images[level * 6 + face];
+            int n = out->size >> level, m = 2 * n;
+            smaller.resize(size_t(n) * n * 3);
+            for (int y = 0; y < n; ++y) {
+                for (int x = 0; x < n; ++x) {
+                    for (int c = 0; c < 3; ++c) {
+                        auto at = [&] (int dx, int dy) {
+                            return larger[(size_t(2*y + dy) * m + 2*x + dx) * 3 + c];
+                        };
+                        smaller[(size_t(y) * n + x) * 3 + c] = uint8_t(
+                            (at(0,0) + at(1,0) + at(0,1) + at(1,1) + 2) / 4);
+                    }
+                }
+            }
+        }
     }
-};
+    return true;
+}
 
-std::vector<BallRender> Ball::recycled_ball_render;
+// Read the skybox of an environment directory: its container if it
+// has one in one of supported_formats, otherwise its BMPs. Returns
+// false and sets *error if neither can be read. Doesn't use OpenGL.
+static bool read_environment(
+    std::string const& directory, std::vector<GLint> const& supported_formats,
+    CubemapImages* out, std::string* error
+) {
+    std::string filename = directory + skybox_container_name;
+    if (read_skybox_container(filename, out, error)) {
+        if (std::count(supported_formats.begin(), supported_formats.end(),
+                       GLint(out->format))) {
+            return true;
+        }
+        fprintf(stderr, "%s: Format 0x%X of %s not supported, "
+                "loading the BMPs instead\n", argv0.c_str(), out->format,
+                filename.c_str());
+    } else if (!error->empty()) {
+        return false;
+    }
+    return read_bmp_cubemap(directory, out, error);
+}
 
-static void load_cubemap_face(GLenum face, const char* filename) {
-    std::string full_filename = argv0 + "Tex/" + filename;
-    SDL_Surface* surface = SDL_LoadBMP(full_filename.c_str());
-    if (surface == nullptr) {
-        panic(SDL_GetError(), full_filename.c_str()); 
+// Upload image i of images to the currently bound cubemap texture,
+// from client memory or (with data = nullptr) from the start of the
+// bound pixel unpack buffer. Expects GL_UNPACK_ALIGNMENT 1.
+static void upload_cubemap_image(
+    CubemapImages const& images, int i, const void* data
+) {
+    int level = i / 6;
+    GLenum face = cubemap_face_enums[i % 6];
+    GLsizei size = std::max(1, images.size >> level);
+    if (images.format == 0) {
+        glTexImage2D(face, level, GL_RGB8, size, size, 0,
+                     GL_BGR, GL_UNSIGNED_BYTE, data);
+    } else {
+        glCompressedTexImage2D(face, level, images.format, size, size, 0,
+                               GLsizei(images.images[i].size()), data);
     }
-    if (surface->w != 512 || surface->h != 512) {
-        panic("Expected 512x512 texture", full_filename.c_str());
+}
+
+// Build the skybox container of the first of the skybox_directories
+// from its BMPs, compressed to format by the driver, for
+// --write-skybox.
+static void write_skybox_container(GLenum format) {
+    std::string directory = skybox_directories.front();
+    std::string filename = directory + skybox_container_name;
+    std::vector<GLint> formats = supported_compressed_formats();
+    if (!std::count(formats.begin(), formats.end(), GLint(format))) {
+        panic("Compressed format not supported by this driver", filename.c_str());
     }
-    if (surface->format->format != SDL_PIXELFORMAT_BGR24) {
-        fprintf(stderr, "%i\n", (int)surface->format->format);
-        panic("Expected 24-bit BGR bitmap", full_filename.c_str());
+    
+    CubemapImages images;
+    std::string error;
+    if (!read_bmp_cubemap(directory, &images, &error)) {
+        panic("Could not read skybox", error.c_str());
     }
     
-    glTexImage2D(face, 0, GL_RGB, 512, 512, 0,
-                  GL_BGR, GL_UNSIGNED_BYTE, surface->pixels);
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (file == nullptr) panic("Could not open skybox container", filename.c_str());
+    uint32_t header[3] = { format, uint32_t(images.size),
+                           uint32_t(images.level_count) };
+    bool okay = fwrite(skybox_container_magic, 1, 4, file) == 4
+             && fwrite(header, sizeof header, 1, file) == 1;
     
-    SDL_FreeSurface(surface);
-}
-
-static GLuint load_cubemap() {
+    // Have the driver compress each image, then read the result back.
     GLuint id = 0;
     glGenTextures(1, &id);
     glBindTexture(GL_TEXTURE_CUBE_MAP, id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    std::vector<uint8_t> compressed;
+    for (int i = 0; i < int(images.images.size()) && okay; ++i) {
+        int level = i / 6;
+        GLenum face = cubemap_face_enums[i % 6];
+        GLsizei size = std::max(1, images.size >> level);
+        glTexImage2D(face, level, format, size, size, 0,
+                     GL_BGR, GL_UNSIGNED_BYTE, images.images[i].data());
+        GLint byte_count = 0;
+        glGetTexLevelParameteriv(face, level,
+            GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &byte_count);
+        compressed.resize(byte_count);
+        glGetCompressedTexImage(face, level, compressed.data());
+        
+        uint32_t count = uint32_t(byte_count);
+        okay = fwrite(&count, sizeof count, 1, file) == 1
+            && fwrite(compressed.data(), 1, count, file) == count;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    glDeleteTextures(1, &id);
+    PANIC_IF_GL_ERROR;
     
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_LOD, 0);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LOD, 8);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0); 
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, 8); 
+    if (fclose(file) != 0 || !okay) {
+        panic("Could not write skybox container", filename.c_str());
+    }
+    printf("Wrote %s\n", filename.c_str());
+}
+
+// The skybox cubemap texture, and switching it for that of another
+// environment without dropping frames. The first of the
+// skybox_directories is loaded synchronously by the first texture()
+// call. After that, request()
+// has a loader thread read (decode) the new environment into memory,
+// then update(), called once per frame, uploads it into a new texture
+// through an orphaned pixel unpack buffer, at most
+// skybox_upload_bytes_per_frame per frame (but at least one image).
+// The new texture replaces the current one only once it's complete.
+class Skybox {
+  public:
+    ~Skybox() {
+        if (loader.joinable()) loader.join();
+    }
     
-    load_cubemap_face(GL_TEXTURE_CUBE_MAP_NEGATIVE_X, "left.bmp");
-    load_cubemap_face(GL_TEXTURE_CUBE_MAP_POSITIVE_X, "right.bmp");
-    load_cubemap_face(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y, "bottom.bmp");
-    load_cubemap_face(GL_TEXTURE_CUBE_MAP_POSITIVE_Y, "top.bmp");
-    load_cubemap_face(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z, "back.bmp");
-    load_cubemap_face(GL_TEXTURE_CUBE_MAP_POSITIVE_Z, "front.bmp");
+    GLuint texture() {
+        if (texture_id == 0) {
+            CubemapImages images;
+            std::string error;
+            if (!read_environment(skybox_directories.front(),
+                                  supported_compressed_formats(), &images, &error)) {
+                panic("Could not load skybox", error.c_str());
+            }
+            texture_id = new_texture(images);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            for (int i = 0; i < int(images.images.size()); ++i) {
+                upload_cubemap_image(images, i, images.images[i].data());
+            }
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+            PANIC_IF_GL_ERROR;
+        }
+        return texture_id;
+    }
     
-    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+    // Start switching to the environment in directory (ending in a
+    // slash). Returns false, doing nothing, if a switch is already
+    // under way.
+    bool request(std::string const& directory) {
+        if (busy) return false;
+        busy = true;
+        loaded = false;
+        std::vector<GLint> formats = supported_compressed_formats();
+        loader = std::thread([this, directory, formats] {
+            load_ok = read_environment(directory, formats, &pending, &load_error);
+            loaded = true;
+        });
+        return true;
+    }
     
-    PANIC_IF_GL_ERROR;
-    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    // Call once per frame.
+    void update() {
+        if (!busy || !loaded) return;
+        if (loader.joinable()) {
+            loader.join();
+            if (!load_ok) {
+                fprintf(stderr, "%s: Could not load skybox: %s\n",
+                        argv0.c_str(), load_error.c_str());
+                busy = false;
+                return;
+            }
+            pending_texture_id = new_texture(pending);
+            next_image = 0;
+            if (upload_buffer_id == 0) glGenBuffers(1, &upload_buffer_id);
+        }
+        
+        ProfileScope scope("skybox upload");
+        glBindTexture(GL_TEXTURE_CUBE_MAP, pending_texture_id);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffer_id);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        size_t bytes = 0;
+        int image_count = int(pending.images.size());
+        while (next_image < image_count) {
+            std::vector<uint8_t> const& image = pending.images[next_image];
+            if (bytes > 0 && bytes + image.size() > skybox_upload_bytes_per_frame) {
+                break;
+            }
+            // Orphan the buffer so that this never waits for the GPU
+            // to finish reading the previous image.
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, image.size(), nullptr, GL_STREAM_DRAW);
+            void* data = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, image.size(),
+                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            if (data == nullptr) panic("Could not map buffer", "(Skybox upload)");
+            memcpy(data, image.data(), image.size());
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            upload_cubemap_image(pending, next_image, nullptr);
+            bytes += image.size();
+            ++next_image;
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+        DRAW_PANIC_IF_GL_ERROR;
+        
+        if (next_image == image_count) {
+            glDeleteTextures(1, &texture_id);
+            texture_id = pending_texture_id;
+            pending_texture_id = 0;
+            ++skybox_generation;
+            pending = CubemapImages();
+            busy = false;
+        }
+    }
     
-    return id;
-}
+  private:
+    static constexpr size_t skybox_upload_bytes_per_frame = 1 << 20;
+    
+    GLuint texture_id = 0;
+    
+    // Switching state, owned by the render thread except for pending,
+    // load_ok and load_error, which belong to the loader until loaded.
+    bool busy = false;
+    std::thread loader;
+    std::atomic<bool> loaded { false };
+    bool load_ok = false;
+    std::string load_error;
+    CubemapImages pending;
+    GLuint pending_texture_id = 0;
+    GLuint upload_buffer_id = 0;
+    int next_image = 0;
+    
+    // A new cubemap texture for images, left bound.
+    static GLuint new_texture(CubemapImages const& images) {
+        GLuint id = 0;
+        glGenTextures(1, &id);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, id);
+        set_cubemap_parameters(images.level_count - 1);
+        return id;
+    }
+};
+
+Skybox skybox;
 
 static const char skybox_vs_source[] =
 "#version 330\n"
 "layout(location=0) in vec3 position;\n"
 "out vec3 texture_coordinate;\n"
-"uniform mat4 view_matrix;\n"
-"uniform mat4 proj_matrix;\n"
+VIEW_BLOCK_GLSL
 "void main() {\n"
+"#ifdef LAYERED\n"
+    "gl_Position = vec4(10*position, 0.0);\n"
+"#else\n"
     "vec4 v = view_matrix * vec4(10*position, 0.0);\n"
     "gl_Position = proj_matrix * vec4(v.xyz, 1);\n"
+"#endif\n"
     "texture_coordinate = position;\n"
 "}\n";
 
@@ -832,29 +4745,27 @@ static const GLushort skybox_elements[36] = {
     2, 3, 7, 2, 7, 6
 };
 
-static void draw_skybox(
-    glm::mat4 view_matrix, glm::mat4 proj_matrix
-) {
-    static bool cubemap_loaded = false;
-    static GLuint cubemap_texture_id;
-    if (!cubemap_loaded) {
-        cubemap_texture_id = load_cubemap();
-        cubemap_loaded = true;
-    }
+static void draw_skybox(LayeredTarget const* layered_target) {
+    ProfileScope scope("skybox");
+    GLuint cubemap_texture_id = skybox.texture();
     
     static GLuint vao = 0;
-    static GLuint program_id;
+    static GLuint program_id[2];
     static GLuint vertex_buffer_id;
     static GLuint element_buffer_id;
-    static GLint view_matrix_id;
-    static GLint proj_matrix_id;
-    static GLint cubemap_uniform_id;
+    static GLint cubemap_uniform_id[2];
+    
+    const int layered = layered_target != nullptr;
     
     if (vao == 0) {
-        program_id = make_program(skybox_vs_source, skybox_fs_source);
-        view_matrix_id = glGetUniformLocation(program_id, "view_matrix");
-        proj_matrix_id = glGetUniformLocation(program_id, "proj_matrix");
-        cubemap_uniform_id = glGetUniformLocation(program_id, "cubemap");
+        program_id[0] = make_program(skybox_vs_source, skybox_fs_source);
+        program_id[1] = make_layered_program(
+            skybox_vs_source, skybox_fs_source,
+            { {"vec3", "texture_coordinate"} }
+        );
+        for (int i = 0; i < 2; ++i) {
+            cubemap_uniform_id[i] = glGetUniformLocation(program_id[i], "cubemap");
+        }
         
         glGenVertexArrays(1, &vao);
         glBindVertexArray(vao);
@@ -885,32 +4796,35 @@ static void draw_skybox(
         PANIC_IF_GL_ERROR;
     }
     
-    glUseProgram(program_id);
+    glUseProgram(program_id[layered]);
     
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap_texture_id);
-    glUniform1i(cubemap_uniform_id, 0);
-    
-    glUniformMatrix4fv(view_matrix_id, 1, 0, &view_matrix[0][0]);
-    glUniformMatrix4fv(proj_matrix_id, 1, 0, &proj_matrix[0][0]);
+    glUniform1i(cubemap_uniform_id[layered], 0);
     
     glBindVertexArray(vao);
     glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, (void*)0);
     glBindVertexArray(0);
     glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
     
-    PANIC_IF_GL_ERROR;
+    DRAW_PANIC_IF_GL_ERROR;
 }
 
 static void draw_scene(
     glm::mat4 view_matrix,
     glm::mat4 proj_matrix,
     BallList const& list,
-    Ball const* skip
+    int skip,
+    LayeredTarget const* layered_target,
+    bool occlusion_cull,
+    bool draw_balls
 ) {
+    set_view_block(view_matrix, proj_matrix, layered_target);
     glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
-    draw_skybox(view_matrix, proj_matrix);
-    Ball::draw_list(view_matrix, proj_matrix, list, skip);
+    draw_skybox(layered_target);
+    if (!draw_balls) return;
+    Ball::draw_list(view_matrix, proj_matrix, list, skip, layered_target,
+                    occlusion_cull);
 }
 
 static bool handle_controls(glm::mat4* view_ptr, glm::mat4* proj_ptr) {
@@ -940,6 +4854,81 @@ static bool handle_controls(glm::mat4* view_ptr, glm::mat4* proj_ptr) {
                 shift = true;
               break; case SDL_SCANCODE_TAB: paused = !paused;
               break; case SDL_SCANCODE_RETURN: do_one_tick = true;
+              break; case SDL_SCANCODE_C:
+                integrator = Integrator((int(integrator.load()) + 1) % 3);
+                printf("Integrator: %s\n", integrator_names[int(integrator.load())]);
+              break; case SDL_SCANCODE_G:
+                layered_probes = !layered_probes;
+                printf("Layered cubemap rendering %s\n",
+                       layered_probes ? "on" : "off");
+              break; case SDL_SCANCODE_R:
+                probes_per_frame = probes_per_frame == 0 ? 1
+                                 : probes_per_frame >= 8 ? 0
+                                 : probes_per_frame * 2;
+                printf("Probes per frame: %i (0 is no limit)\n", probes_per_frame);
+              break; case SDL_SCANCODE_B:
+                probe_budget_ms = probe_budget_ms >= 4.0f ? 0.0f
+                                : probe_budget_ms == 0.0f ? 1.0f
+                                : probe_budget_ms * 2.0f;
+                printf("Probe time budget: %.0f ms (0 is no limit)\n",
+                       probe_budget_ms);
+              break; case SDL_SCANCODE_T:
+                stagger_probe_faces = !stagger_probe_faces;
+                printf("Probe face staggering %s\n",
+                       stagger_probe_faces ? "on" : "off");
+              break; case SDL_SCANCODE_P:
+                reflection_lod = !reflection_lod;
+                printf("Reflection LOD %s\n", reflection_lod ? "on" : "off");
+              break; case SDL_SCANCODE_X:
+                occlusion_culling = !occlusion_culling;
+                printf("Occlusion culling %s\n", occlusion_culling ? "on" : "off");
+              break; case SDL_SCANCODE_M:
+                impostor_balls = !impostor_balls;
+                printf("Impostor balls %s\n", impostor_balls ? "on" : "off");
+              break; case SDL_SCANCODE_H:
+                profiling = !profiling;
+                printf("Profiler %s\n", profiling
+                    ? "on (overlay bottom left, summary with the FPS, "
+                      "Y writes bouncy_trace.json)" : "off");
+              break; case SDL_SCANCODE_Y:
+                if (!profiling) {
+                    printf("Profiler is off (H turns it on)\n");
+                } else if (profiler.write_trace("bouncy_trace.json")) {
+                    printf("Wrote bouncy_trace.json\n");
+                } else {
+                    printf("Could not write bouncy_trace.json\n");
+                }
+              break; case SDL_SCANCODE_Z:
+                reflection_bounces = (reflection_bounces + 1) % 3;
+                printf("Reflection bounces: %d%s\n", reflection_bounces,
+                       reflection_bounces == 2 ? " (from the previous frame)" : "");
+              break; case SDL_SCANCODE_F5:
+                save_scene_pending = true;
+              break; case SDL_SCANCODE_F9:
+                restore_scene_pending = true;
+              break; case SDL_SCANCODE_V:
+                adaptive_resolution = !adaptive_resolution;
+                if (adaptive_resolution) {
+                    printf("Adaptive resolution on (target %.1f ms)\n",
+                           target_frame_ms);
+                } else {
+                    printf("Adaptive resolution off\n");
+                }
+              break; case SDL_SCANCODE_N: {
+                static size_t environment = 0;
+                size_t next = (environment + 1) % skybox_directories.size();
+                if (skybox.request(skybox_directories[next])) {
+                    environment = next;
+                    printf("Switching skybox to %s\n",
+                           skybox_directories[next].c_str());
+                } else {
+                    printf("Still switching skybox\n");
+                }
+              }
+              break; case SDL_SCANCODE_F:
+                interpolate_snapshots = !interpolate_snapshots;
+                printf("Snapshot interpolation %s\n",
+                       interpolate_snapshots ? "on" : "off");
               break; case SDL_SCANCODE_0: tick_dt = base_tick_dt * 10;
               break; case SDL_SCANCODE_1: case SDL_SCANCODE_2: case SDL_SCANCODE_3:
                      case SDL_SCANCODE_4: case SDL_SCANCODE_5: case SDL_SCANCODE_6:
@@ -1024,20 +5013,609 @@ static bool handle_controls(glm::mat4* view_ptr, glm::mat4* proj_ptr) {
     return no_quit;
 }
 
-int Main(int, char** argv) {
+// Command line options:
+//
+//     --probe-dim N          reflection probe faces are N x N (default 512)
+//     --probe-format NAME    probe color format: rgb8 (default),
+//                            r11f_g11f_b10f or rgba16f
+//     --physics cpu|gpu      run the physics on a CPU thread (default) or
+//                            on the GPU; see GpuPhysics
+//     --ball-count N         number of balls (default 18)
+//     --ball-radius R        radius of the balls (default 0.1), or
+//                            MIN:MAX for random radii in that range
+//     --gravity G            downward acceleration (default 0)
+//     --scene F              load the box, gravity and balls from the
+//                            scene file F instead of spawning random
+//                            balls; see SceneHeader. F9 restores
+//                            quick_save_path, which F5 saves.
+//     --write-scene F        write the starting scene (spawned or
+//                            loaded) to the scene file F and exit
+//     --record F             record the state after every physics step
+//                            to F; see Recorder
+//     --replay F             move the balls as recorded in F (starting
+//                            from its scene) instead of running physics
+//     --replay-start N       start the replay after step N
+//     --ticks-per-frame N    Euler substeps per physics step (default 20)
+//     --seed N               seed for the initial balls
+//     --benchmark N          run N frames headless and report frame
+//                            times; see run_benchmark
+//     --benchmark-output F   also write the benchmark results to F
+//     --capture F            render offscreen and write raw RGBA video to
+//                            F ("-" for stdout), for example piped into
+//                            ffmpeg -f rawvideo -pix_fmt rgba -s 1920x1080
+//                            -framerate 60 -i - out.mp4; see FrameCapture
+//     --capture-size WxH     captured frame size (default 1920x1080)
+//     --capture-frames N     number of frames to capture (default 600)
+//     --write-skybox FORMAT  build the prebuilt skybox (see
+//                            skybox_container_name) in FORMAT: bc1, bc6h
+//                            or etc2, and exit
+//     --skybox DIR           add an environment (a directory with the six
+//                            face BMPs and maybe a prebuilt skybox); N
+//                            switches between them. The default is the
+//                            texture directory.
+//     --reflection-bounces N reflections show 0 (only the skybox), 1 or
+//                            2 (the default) bounces; Z cycles through
+//                            them. See ProbeScheduler
+//     --target-fps N         turn on adaptive resolution (V toggles it),
+//                            aiming for N frames per second (default 60);
+//                            see ResolutionScaler
+static void parse_args(int argc, char** argv) {
+    const struct {
+        const char* name;
+        GLenum format;
+    } probe_formats[] = {
+        { "rgb8", GL_RGB8 },
+        { "r11f_g11f_b10f", GL_R11F_G11F_B10F },
+        { "rgba16f", GL_RGBA16F },
+    };
+    
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) panic("Missing value for option", argv[i]);
+        const char* value = argv[++i];
+        
+        if (arg == "--probe-dim") {
+            probe_dim = atoi(value);
+            if (probe_dim < 1) panic("Invalid --probe-dim", value);
+        } else if (arg == "--probe-format") {
+            auto it = std::find_if(
+                std::begin(probe_formats), std::end(probe_formats),
+                [value] (decltype(probe_formats[0]) f) {
+                    return strcmp(f.name, value) == 0;
+                });
+            if (it == std::end(probe_formats)) {
+                panic("Unknown --probe-format", value);
+            }
+            probe_format = it->format;
+        } else if (arg == "--physics") {
+            if (strcmp(value, "cpu") == 0) {
+                gpu_physics = false;
+            } else if (strcmp(value, "gpu") == 0) {
+                gpu_physics = true;
+            } else {
+                panic("Unknown --physics", value);
+            }
+        } else if (arg == "--ball-count") {
+            ball_count = atoi(value);
+            if (ball_count < 1) panic("Invalid --ball-count", value);
+        } else if (arg == "--ball-radius") {
+            int count = sscanf(value, "%f:%f", &spawn_min_radius, &spawn_max_radius);
+            if (count == 1) spawn_max_radius = spawn_min_radius;
+            if (count < 1 || !(spawn_min_radius > 0)
+                || !(spawn_max_radius >= spawn_min_radius)) {
+                panic("Invalid --ball-radius", value);
+            }
+        } else if (arg == "--gravity") {
+            gravity = float(atof(value));
+        } else if (arg == "--scene") {
+            scene_path = value;
+        } else if (arg == "--write-scene") {
+            write_scene_path = value;
+        } else if (arg == "--record") {
+            record_path = value;
+        } else if (arg == "--replay") {
+            replay_path = value;
+        } else if (arg == "--replay-start") {
+            replay_start = atoi(value);
+            if (replay_start < 0) panic("Invalid --replay-start", value);
+        } else if (arg == "--ticks-per-frame") {
+            ticks_per_frame = atoi(value);
+            if (ticks_per_frame < 1) panic("Invalid --ticks-per-frame", value);
+        } else if (arg == "--seed") {
+            random_seed = atoll(value);
+            if (random_seed < 0) panic("Invalid --seed", value);
+        } else if (arg == "--benchmark") {
+            benchmark_frames = atoi(value);
+            if (benchmark_frames < 1) panic("Invalid --benchmark", value);
+        } else if (arg == "--benchmark-output") {
+            benchmark_output = value;
+        } else if (arg == "--capture") {
+            capture_path = value;
+        } else if (arg == "--capture-size") {
+            if (sscanf(value, "%dx%d", &capture_width, &capture_height) != 2
+                || capture_width < 1 || capture_height < 1) {
+                panic("Invalid --capture-size", value);
+            }
+        } else if (arg == "--write-skybox") {
+            const struct {
+                const char* name;
+                GLenum format;
+            } skybox_formats[] = {
+                { "bc1", texture_compression::rgb_s3tc_dxt1 },
+                { "bc6h", texture_compression::rgb_bptc_unsigned_float },
+                { "etc2", texture_compression::rgb8_etc2 },
+            };
+            write_skybox_format = 0;
+            for (auto const& f : skybox_formats) {
+                if (strcmp(f.name, value) == 0) write_skybox_format = f.format;
+            }
+            if (write_skybox_format == 0) panic("Unknown --write-skybox", value);
+        } else if (arg == "--skybox") {
+            std::string directory = value;
+            if (directory.back() != '/') directory += '/';
+            skybox_directories.push_back(directory);
+        } else if (arg == "--reflection-bounces") {
+            reflection_bounces = atoi(value);
+            if (reflection_bounces < 0 || reflection_bounces > 2) {
+                panic("Invalid --reflection-bounces", value);
+            }
+        } else if (arg == "--target-fps") {
+            float fps = float(atof(value));
+            if (!(fps > 0)) panic("Invalid --target-fps", value);
+            target_frame_ms = 1000.0f / fps;
+            adaptive_resolution = true;
+        } else if (arg == "--capture-frames") {
+            capture_frames = atoi(value);
+            if (capture_frames < 1) panic("Invalid --capture-frames", value);
+        } else {
+            panic("Unknown option", arg.c_str());
+        }
+    }
+}
+
+// Set *view and *proj to the camera of the non-interactive modes for a
+// frame: circling the box once every orbit_camera_frames, looking at
+// its center.
+static void orbit_camera(int frame, float aspect, glm::mat4* view, glm::mat4* proj) {
+    glm::vec3 center(0.5f*(min_x+max_x), 0.5f*(min_y+max_y), 0.5f*(min_z+max_z));
+    float angle = 6.2831853f * frame / orbit_camera_frames;
+    glm::vec3 eye = center + glm::vec3(2.5f*cosf(angle), 0.5f, 2.5f*sinf(angle));
+    *view = glm::lookAt(eye, center, glm::vec3(0,1,0));
+    *proj = glm::perspective(fovy_radians, aspect, near_plane, far_plane);
+}
+
+// Create every program and the skybox texture before the first frame,
+// by drawing each path once (layered and per face probes, with and
+// without impostors, and the main view with occlusion queries) into a
+// spare probe and the window, so that nothing compiles in the middle
+// of the run. Then save any newly linked programs to the
+// program_cache.
+static void warm_up(BallList const& list) {
+    glm::mat4 view_matrix, proj_matrix;
+    orbit_camera(0, float(screen_x)/screen_y, &view_matrix, &proj_matrix);
+    int slot = new_probe_slot();
+    std::vector<int> slots(list.size(), slot);
+    Ball::upload_instances(list, slots.data());
+    glm::vec3 center(0.5f*(min_x+max_x), 0.5f*(min_y+max_y), 0.5f*(min_z+max_z));
+    
+    bool saved_layered_probes = layered_probes;
+    bool saved_impostor_balls = impostor_balls;
+    for (bool impostors : { false, true }) {
+        impostor_balls = impostors;
+        layered_probes = true;
+        Ball::draw_probe(list, center, near_plane, slot);
+        layered_probes = false;
+        Ball::draw_probe(list, center, near_plane, slot, -1, 0, 1);
+        
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        set_viewport(screen_x, screen_y);
+        draw_scene(view_matrix, proj_matrix, list, -1, nullptr, true);
+    }
+    layered_probes = saved_layered_probes;
+    impostor_balls = saved_impostor_balls;
+    free_probe_slot(slot);
+    
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    // Drivers may put off compiling until a program is actually used.
+    glFinish();
+    PANIC_IF_GL_ERROR;
+    program_cache.save();
+}
+
+// Summary of one benchmark stage's frame times, in milliseconds.
+struct StageStats {
+    double min_ms, mean_ms, p50_ms, p99_ms;
+    
+    explicit StageStats(std::vector<double> times) {
+        assert(!times.empty());
+        std::sort(times.begin(), times.end());
+        auto percentile = [&times] (double p) {
+            return times[size_t(p * (times.size() - 1) + 0.5)];
+        };
+        min_ms = times.front();
+        mean_ms = std::accumulate(times.begin(), times.end(), 0.0) / times.size();
+        p50_ms = percentile(0.50);
+        p99_ms = percentile(0.99);
+    }
+};
+
+// Run benchmark_frames frames of the scene in list with the benchmark
+// camera, then print how long each stage took and write the same
+// statistics to benchmark_output (JSON if its name ends in .json, CSV
+// otherwise) if that's set. The physics is stepped once per frame on
+// this thread (on the GPU with gpu_simulation) instead of on the
+// Simulation thread's clock, so the same seed and options give the
+// same frames every run. Each stage ends with glFinish so that GPU
+// work is charged to the stage that queued it; the first
+// benchmark_warmup_frames (shader compiles, probe allocation) aren't
+// counted.
+static void run_benchmark(
+    BallList* list, GpuPhysics* gpu_simulation, Replay* replay,
+    Recorder* recorder, ProbeScheduler* probe_scheduler
+) {
+    typedef std::chrono::steady_clock clock;
+    enum { physics_stage, probes_stage, draw_stage, frame_stage, stage_count };
+    const char* const stage_names[stage_count] = {
+        "physics", "probes", "draw", "frame"
+    };
+    std::vector<double> times[stage_count];
+    auto ms = [] (clock::time_point a, clock::time_point b) {
+        return std::chrono::duration<double, std::milli>(b - a).count();
+    };
+    
+    SDL_GL_SetSwapInterval(0);
+    glm::mat4 view_matrix, proj_matrix;
+    for (int frame = -benchmark_warmup_frames; frame < benchmark_frames; ++frame) {
+        SDL_PumpEvents();
+        orbit_camera(frame, float(screen_x)/screen_y, &view_matrix, &proj_matrix);
+        auto start = clock::now();
+        
+        if (gpu_simulation) {
+            // Records the step itself, if there is a recorder.
+            gpu_simulation->step(tick_dt, integrator);
+            glFinish();
+            gpu_simulation->read_positions(&list->physics);
+            Ball::gpu_state_buffer = gpu_simulation->state_buffer();
+        } else {
+            if (replay) {
+                replay->advance(&list->physics);
+            } else {
+                list->physics.step(tick_dt, integrator);
+            }
+            if (recorder) recorder->record(list->physics);
+        }
+        auto physics_done = clock::now();
+        
+        probe_scheduler->assign_probes(*list, view_matrix, proj_matrix);
+        Ball::upload_instances(*list, probe_scheduler->probe_slots());
+        probe_scheduler->update(*list);
+        glFinish();
+        auto probes_done = clock::now();
+        
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        set_viewport(screen_x, screen_y);
+        draw_scene(view_matrix, proj_matrix, *list, -1, nullptr, occlusion_culling);
+        SDL_GL_SwapWindow(window);
+        glFinish();
+        auto draw_done = clock::now();
+        DRAW_PANIC_IF_GL_ERROR;
+        
+        if (frame < 0) continue;
+        times[physics_stage].push_back(ms(start, physics_done));
+        times[probes_stage].push_back(ms(physics_done, probes_done));
+        times[draw_stage].push_back(ms(probes_done, draw_done));
+        times[frame_stage].push_back(ms(start, draw_done));
+    }
+    
+    const char* physics_name = replay ? "replay" : gpu_simulation ? "gpu" : "cpu";
+    std::vector<StageStats> stats;
+    printf("%d frames, %d balls, %d ticks per frame, probe dim %d, %s physics\n",
+           benchmark_frames, ball_count, ticks_per_frame, probe_dim,
+           physics_name);
+    printf("%-8s %9s %9s %9s %9s\n", "stage", "min ms", "mean ms", "p50 ms", "p99 ms");
+    for (int i = 0; i < stage_count; ++i) {
+        stats.emplace_back(times[i]);
+        printf("%-8s %9.3f %9.3f %9.3f %9.3f\n", stage_names[i],
+               stats[i].min_ms, stats[i].mean_ms, stats[i].p50_ms, stats[i].p99_ms);
+    }
+    
+    if (benchmark_output.empty()) return;
+    FILE* file = fopen(benchmark_output.c_str(), "w");
+    if (file == nullptr) {
+        panic("Could not open benchmark output", benchmark_output.c_str());
+    }
+    const std::string json_suffix = ".json";
+    bool json = benchmark_output.size() >= json_suffix.size()
+             && benchmark_output.compare(benchmark_output.size() - json_suffix.size(),
+                                         json_suffix.size(), json_suffix) == 0;
+    if (json) {
+        fprintf(file, "{\n  \"frames\": %d,\n  \"ball_count\": %d,\n"
+                "  \"ticks_per_frame\": %d,\n  \"probe_dim\": %d,\n"
+                "  \"seed\": %lld,\n  \"physics\": \"%s\",\n  \"stages\": {\n",
+                benchmark_frames, ball_count, ticks_per_frame, probe_dim,
+                (long long)random_seed, physics_name);
+        for (int i = 0; i < stage_count; ++i) {
+            fprintf(file, "    \"%s\": { \"min_ms\": %.4f, \"mean_ms\": %.4f, "
+                    "\"p50_ms\": %.4f, \"p99_ms\": %.4f }%s\n", stage_names[i],
+                    stats[i].min_ms, stats[i].mean_ms, stats[i].p50_ms,
+                    stats[i].p99_ms, i + 1 < stage_count ? "," : "");
+        }
+        fprintf(file, "  }\n}\n");
+    } else {
+        fprintf(file, "stage,frames,ball_count,ticks_per_frame,probe_dim,seed,"
+                "physics,min_ms,mean_ms,p50_ms,p99_ms\n");
+        for (int i = 0; i < stage_count; ++i) {
+            fprintf(file, "%s,%d,%d,%d,%d,%lld,%s,%.4f,%.4f,%.4f,%.4f\n",
+                    stage_names[i], benchmark_frames, ball_count,
+                    ticks_per_frame, probe_dim, (long long)random_seed,
+                    physics_name, stats[i].min_ms,
+                    stats[i].mean_ms, stats[i].p50_ms, stats[i].p99_ms);
+        }
+    }
+    if (fclose(file) != 0) {
+        panic("Could not write benchmark output", benchmark_output.c_str());
+    }
+}
+
+// Renders frames offscreen at any size and streams them out as raw
+// RGBA8 video, top row first (--capture). Draw each frame into
+// framebuffer() and call capture(), which starts an asynchronous
+// glReadPixels into the next of a ring of pixel pack buffers and
+// hands the oldest one's pixels to a writer thread. A frame is only
+// mapped pbo_count - 1 frames after its read was queued, when the GPU
+// has normally long finished it, so the render thread doesn't stall
+// on the readback. A full write queue (a slow pipe or disk) does block
+// it, since frames of a video can't be dropped.
+class FrameCapture {
+  public:
+    FrameCapture(int width_arg, int height_arg, const char* path)
+        : width(width_arg), height(height_arg) {
+        file = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+        if (file == nullptr) panic("Could not open capture output", path);
+        
+        PANIC_IF_GL_ERROR;
+        glGenRenderbuffers(2, renderbuffers);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        
+        glGenFramebuffers(1, &framebuffer_id);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_id);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  GL_RENDERBUFFER, renderbuffers[0]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                  GL_RENDERBUFFER, renderbuffers[1]);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            panic("Capture framebuffer incomplete", path);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        
+        for (Readback& readback : readbacks) {
+            glGenBuffers(1, &readback.buffer_id);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer_id);
+            glBufferData(GL_PIXEL_PACK_BUFFER, frame_bytes(), nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        PANIC_IF_GL_ERROR;
+        
+        writer = std::thread(&FrameCapture::run_writer, this);
+    }
+    
+    // Writes out the frames still in flight.
+    ~FrameCapture() {
+        for (int n = 0; n < pbo_count; ++n) {
+            retire(&readbacks[(next + n) % pbo_count]);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        queue_changed.notify_all();
+        writer.join();
+        
+        if (fflush(file) != 0 || (file != stdout && fclose(file) != 0)) {
+            write_failed = true;
+        }
+        if (write_failed) {
+            fprintf(stderr, "%s: Could not write all captured frames\n",
+                    argv0.c_str());
+        }
+        for (Readback& readback : readbacks) {
+            glDeleteBuffers(1, &readback.buffer_id);
+        }
+        glDeleteFramebuffers(1, &framebuffer_id);
+        glDeleteRenderbuffers(2, renderbuffers);
+    }
+    
+    FrameCapture(FrameCapture const&) = delete;
+    FrameCapture& operator=(FrameCapture const&) = delete;
+    
+    GLuint framebuffer() const {
+        return framebuffer_id;
+    }
+    
+    // Queue what was drawn to framebuffer() as the next frame.
+    void capture() {
+        Readback* readback = &readbacks[next];
+        next = (next + 1) % pbo_count;
+        retire(readback);
+        
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer_id);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer_id);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    
+  private:
+    static constexpr int pbo_count = 3, max_queued_frames = 4;
+    
+    struct Readback {
+        GLuint buffer_id = 0;
+        GLsync fence = nullptr; // Frame in flight, if not null.
+    };
+    
+    int width, height;
+    FILE* file;
+    GLuint framebuffer_id;
+    GLuint renderbuffers[2]; // Color, depth.
+    Readback readbacks[pbo_count];
+    int next = 0;
+    
+    // Shared with the writer thread.
+    std::mutex mutex;
+    std::condition_variable queue_changed;
+    std::deque<std::vector<uint8_t>> queue; // Bottom row first.
+    std::vector<std::vector<uint8_t>> spare_frames;
+    bool quit = false;
+    std::atomic<bool> write_failed { false };
+    std::thread writer;
+    
+    size_t frame_bytes() const {
+        return size_t(width) * height * 4;
+    }
+    
+    // If readback has a frame in flight, wait for it to finish (it
+    // normally has) and queue its pixels for the writer.
+    void retire(Readback* readback) {
+        if (readback->fence == nullptr) return;
+        GLenum status = glClientWaitSync(
+            readback->fence, GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(10e9));
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            panic("Capture readback failed", "(glClientWaitSync)");
+        }
+        glDeleteSync(readback->fence);
+        readback->fence = nullptr;
+        
+        std::vector<uint8_t> pixels;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queue_changed.wait(lock, [this] {
+                return int(queue.size()) < max_queued_frames;
+            });
+            if (!spare_frames.empty()) {
+                pixels = std::move(spare_frames.back());
+                spare_frames.pop_back();
+            }
+        }
+        pixels.resize(frame_bytes());
+        
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer_id);
+        const void* data = glMapBufferRange(
+            GL_PIXEL_PACK_BUFFER, 0, frame_bytes(), GL_MAP_READ_BIT);
+        if (data == nullptr) {
+            panic("Could not map buffer", "(FrameCapture readback)");
+        }
+        memcpy(pixels.data(), data, frame_bytes());
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(pixels));
+        }
+        queue_changed.notify_all();
+    }
+    
+    void run_writer() {
+        const size_t row_bytes = size_t(width) * 4;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            queue_changed.wait(lock, [this] { return quit || !queue.empty(); });
+            if (queue.empty()) return;
+            std::vector<uint8_t> pixels = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            queue_changed.notify_all();
+            
+            for (int y = height - 1; y >= 0 && !write_failed; --y) {
+                if (fwrite(&pixels[y * row_bytes], 1, row_bytes, file) != row_bytes) {
+                    write_failed = true;
+                }
+            }
+            
+            lock.lock();
+            spare_frames.push_back(std::move(pixels));
+        }
+    }
+};
+
+// Render capture_frames frames with the orbit camera into capture,
+// stepping the physics once per frame on this thread (on the GPU with
+// gpu_simulation). This runs as fast as the GPU and the output allow:
+// nothing is drawn to the window and it never swaps.
+static void run_capture(
+    BallList* list, GpuPhysics* gpu_simulation, Replay* replay,
+    Recorder* recorder, ProbeScheduler* probe_scheduler, FrameCapture* capture
+) {
+    glm::mat4 view_matrix, proj_matrix;
+    float aspect = float(capture_width) / capture_height;
+    fprintf(stderr, "Capturing %d frames of %dx%d RGBA to %s\n", capture_frames,
+            capture_width, capture_height, capture_path.c_str());
+    
+    for (int frame = 0; frame < capture_frames; ++frame) {
+        SDL_PumpEvents();
+        orbit_camera(frame, aspect, &view_matrix, &proj_matrix);
+        if (gpu_simulation) {
+            // Wait for this step's readback, so that each captured frame
+            // shows its own step. Records the step too, if there is a
+            // recorder.
+            gpu_simulation->step(tick_dt, integrator);
+            glFinish();
+            gpu_simulation->read_positions(&list->physics);
+            Ball::gpu_state_buffer = gpu_simulation->state_buffer();
+        } else {
+            if (replay) {
+                replay->advance(&list->physics);
+            } else {
+                list->physics.step(tick_dt, integrator);
+            }
+            if (recorder) recorder->record(list->physics);
+        }
+        
+        probe_scheduler->assign_probes(*list, view_matrix, proj_matrix);
+        Ball::upload_instances(*list, probe_scheduler->probe_slots());
+        probe_scheduler->update(*list);
+        
+        glBindFramebuffer(GL_FRAMEBUFFER, capture->framebuffer());
+        set_viewport(capture_width, capture_height);
+        draw_scene(view_matrix, proj_matrix, *list, -1, nullptr, occlusion_culling);
+        capture->capture();
+        DRAW_PANIC_IF_GL_ERROR;
+        
+        if ((frame + 1) % 60 == 0) {
+            fprintf(stderr, "Captured %d/%d frames\n", frame + 1, capture_frames);
+        }
+    }
+}
+
+int Main(int argc, char** argv) {
     argv0 = argv[0];
+    parse_args(argc, argv);
+    if (skybox_directories.empty()) skybox_directories.push_back(argv0 + "Tex/");
+    bool interactive = benchmark_frames == 0 && capture_path.empty()
+                    && write_skybox_format == 0;
     
     window = SDL_CreateWindow(
         "Bouncy",
         SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
         screen_x, screen_y,
-        SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE
+        SDL_WINDOW_OPENGL |
+            (interactive ? SDL_WINDOW_RESIZABLE : SDL_WINDOW_HIDDEN)
     );
     if (window == nullptr) {
         panic("Could not initialize window", SDL_GetError());
     }
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+#ifdef BOUNCY_CHECKED_GL
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_DEBUG_FLAG);
+#endif
     
     auto context = SDL_GL_CreateContext(window);
     if (context == nullptr) {
@@ -1048,6 +5626,15 @@ int Main(int, char** argv) {
     }
     
     ogl_LoadFunctions();
+    if (!install_gl_debug_callback()) {
+        fprintf(stderr, "%s: KHR_debug not supported; OpenGL errors "
+                "are only reported in checked builds\n", argv0.c_str());
+    }
+    if (write_skybox_format != 0) {
+        write_skybox_container(write_skybox_format);
+        return 0;
+    }
+    program_cache.load();
     
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -1060,76 +5647,194 @@ int Main(int, char** argv) {
     
     glm::mat4 view_matrix, proj_matrix;
     BallList list;
+    JobPool jobs(int(std::thread::hardware_concurrency()));
+    list.physics.jobs = &jobs;
     
-    srandom(static_cast<unsigned int>(time(nullptr)));
+    if (random_seed < 0) {
+        random_seed = interactive ? int64_t(time(nullptr)) : 1;
+    }
+    srandom(static_cast<unsigned int>(random_seed));
     auto rnd = [](float min, float max) {
         float result = uint16_t(random()) * ((max-min)/65535.f) + min;
         return result;
     };
     
-    for (int i = 0; i < ball_count; ++i) {
+    std::unique_ptr<Replay> replay;
+    if (!replay_path.empty()) {
+        replay.reset(new Replay(replay_path));
+        load_scene(replay->scene(), &list);
+        replay->seek(replay_start);
+        replay->advance(&list.physics);
+    } else if (!scene_path.empty()) {
+        MappedFile file(scene_path);
+        std::string error;
+        SceneHeader const* header = scene_header(file.data(), file.size(), &error);
+        if (header == nullptr) {
+            panic("Could not read scene", (scene_path + ": " + error).c_str());
+        }
+        load_scene(header, &list);
+    }
+    for (int i = 0; !replay && scene_path.empty() && i < ball_count; ++i) {
+        float radius = spawn_min_radius;
+        if (spawn_max_radius > spawn_min_radius) {
+            radius = rnd(spawn_min_radius, spawn_max_radius);
+        }
         list.emplace_back(
             glm::vec3(rnd(min_x, max_x), rnd(min_y, max_y), rnd(min_z, max_z)),
             glm::vec3(rnd(-3, 3), rnd(1, 4.5), rnd(-3, 3)),
             std::min(1.0f, std::max(0.0f, rnd(-1.5f, 2.5f))),
             std::min(1.0f, std::max(0.0f, rnd(-1.5f, 2.5f))),
             std::min(1.0f, std::max(0.0f, rnd(-1.5f, 2.5f))),
-            ball_radius
+            radius
         );
     }
+    if (!write_scene_path.empty()) {
+        if (!write_scene(write_scene_path, list, list.physics)) {
+            panic("Could not write scene", write_scene_path.c_str());
+        }
+        printf("Wrote %s\n", write_scene_path.c_str());
+        return 0;
+    }
+    
+    std::unique_ptr<Recorder> recorder;
+    if (!record_path.empty()) {
+        std::vector<uint8_t> scene;
+        encode_scene(list, list.physics, &scene);
+        recorder.reset(new Recorder(record_path, list.size(), scene));
+    }
+    
+    // At most one of these runs the physics; neither does when
+    // replaying, or when benchmarking or capturing on the CPU, which
+    // step list.physics themselves.
+    std::unique_ptr<Simulation> simulation;
+    std::unique_ptr<GpuPhysics> gpu_simulation;
+    auto start_physics = [&] {
+        if (replay) return;
+        if (gpu_physics) {
+            gpu_simulation.reset(new GpuPhysics(list.physics, recorder.get()));
+        } else if (interactive) {
+            simulation.reset(new Simulation(list.physics, recorder.get()));
+        }
+    };
+    start_physics();
+    ProbeScheduler probe_scheduler;
+    warm_up(list);
+    
+    if (benchmark_frames > 0) {
+        run_benchmark(&list, gpu_simulation.get(), replay.get(), recorder.get(),
+                      &probe_scheduler);
+        return 0;
+    }
+    if (!capture_path.empty()) {
+        FrameCapture capture(capture_width, capture_height, capture_path.c_str());
+        run_capture(&list, gpu_simulation.get(), replay.get(), recorder.get(),
+                    &probe_scheduler, &capture);
+        return 0;
+    }
     
     auto previous_update = SDL_GetTicks();
     auto previous_fps_print = SDL_GetTicks();
     int frames = 0;
     
     while (no_quit) {
+        profiler.begin_frame();
+        resolution_scaler.begin_frame();
         auto current_tick = SDL_GetTicks();
-        if (current_tick >= previous_update + 16) {
+        if (current_tick >= previous_update + sim_period_ms) {
             no_quit = handle_controls(&view_matrix, &proj_matrix);
-            previous_update += 16;
+            previous_update += sim_period_ms;
+            
+            if (save_scene_pending) {
+                save_scene_pending = false;
+                BallPhysics state = list.physics; // As replayed.
+                if (simulation) {
+                    simulation->copy_state(&state);
+                } else if (gpu_simulation) {
+                    gpu_simulation->read_state(&state);
+                }
+                if (write_scene(quick_save_path, list, state)) {
+                    printf("Saved the scene to %s\n", quick_save_path.c_str());
+                } else {
+                    printf("Could not write %s\n", quick_save_path.c_str());
+                }
+            }
+            if (restore_scene_pending) {
+                restore_scene_pending = false;
+                MappedFile file(quick_save_path);
+                std::string error;
+                SceneHeader const* header
+                    = scene_header(file.data(), file.size(), &error);
+                if (replay || recorder) {
+                    printf("Can't restore a scene while %s\n",
+                           replay ? "replaying" : "recording");
+                } else if (header != nullptr) {
+                    simulation.reset();
+                    gpu_simulation.reset();
+                    load_scene(header, &list);
+                    start_physics();
+                    printf("Restored %d balls from %s\n", list.size(),
+                           quick_save_path.c_str());
+                } else {
+                    printf("Could not restore %s: %s\n",
+                           quick_save_path.c_str(), error.c_str());
+                }
+            }
             if (current_tick - previous_update > 100) {
                 previous_update = current_tick;
             }
             
-            if (!paused || do_one_tick) {
-                do_one_tick = false;
-                for (Ball& ball : list) {
-                    ball.bounce_bounds();
-                    for (int i = 0; i < ticks_per_frame; ++i) {
-                        ball.tick(tick_dt / ticks_per_frame);
-                    }
-                    ball.reset_bounce_flag();
-                }
-                                
-                for (Ball& ball : list) {
-                    for (Ball& other : list) {
-                        if (&ball != &other
-                            && !ball.bounce_flag()
-                            && !other.bounce_flag()
-                        ) {
-                            ball.bounce_ball(&other);
-                        }
+            if (gpu_simulation || replay) {
+                ProfileScope scope("physics");
+                bool one_tick = do_one_tick.exchange(false);
+                if (!paused || one_tick) {
+                    if (replay) {
+                        replay->advance(&list.physics);
+                    } else {
+                        gpu_simulation->step(tick_dt, integrator);
                     }
                 }
             }
-            ++frames;
+            
             if (current_tick >= previous_fps_print + 2000) {
                 float fps = 1000.0 * frames / (current_tick-previous_fps_print);
                 printf("%4.1f FPS\n", fps);
+                if (profiling) profiler.print_summary();
+                if (adaptive_resolution) resolution_scaler.print_status();
                 previous_fps_print = current_tick;
                 frames = 0;
             }
         }
         
-        for (Ball& ball : list) {
-            ball.update_reflection_texture(list);
+        {
+            ProfileScope scope("read positions");
+            if (simulation) {
+                simulation->read_positions(&list.physics, interpolate_snapshots);
+            } else if (gpu_simulation) {
+                gpu_simulation->read_positions(&list.physics);
+                Ball::gpu_state_buffer = gpu_simulation->state_buffer();
+            }
+        }
+        skybox.update();
+        {
+            ProfileScope scope("probes");
+            probe_scheduler.assign_probes(list, view_matrix, proj_matrix);
+            Ball::upload_instances(list, probe_scheduler.probe_slots());
+            probe_scheduler.update(list);
         }
         
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glViewport(0, 0, screen_x, screen_y);
-        draw_scene(view_matrix, proj_matrix, list);
-        SDL_GL_SwapWindow(window);
-        PANIC_IF_GL_ERROR;
+        resolution_scaler.begin_main_view(screen_x, screen_y);
+        {
+            ProfileScope scope("main view");
+            draw_scene(view_matrix, proj_matrix, list, -1, nullptr, occlusion_culling);
+        }
+        resolution_scaler.end_main_view(screen_x, screen_y);
+        if (profiling) profiler.draw_overlay();
+        {
+            ProfileScope scope("swap");
+            SDL_GL_SwapWindow(window);
+        }
+        DRAW_PANIC_IF_GL_ERROR;
+        ++frames;
     }
     
     return 0;
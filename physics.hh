@@ -0,0 +1,785 @@
+// Bouncy ball physics: the balls' state and the kernels that move and
+// bounce them, with no OpenGL or SDL. bouncy.cc runs it and
+// physics_bench.cc times it. Each of those is a whole program in one
+// translation unit, so like them this defines everything in an
+// anonymous namespace instead of just declaring it.
+
+#ifndef BOUNCY_PHYSICS_HH
+#define BOUNCY_PHYSICS_HH
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+using std::swap;
+
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+namespace {
+
+// How BallPhysics::step moves the balls over one frame.
+//
+// euler_substeps: bounce off the walls, then ticks_per_frame Euler ticks.
+// closed_form: bounce off the walls, then move along the exact
+//     constant-gravity trajectory for the whole frame in one step.
+// continuous: like closed_form, but find the exact time each ball hits
+//     a wall during the frame and bounce it there, so balls can't go
+//     through walls however big tick_dt is.
+//
+// Ball-ball collisions are checked once per frame in every mode.
+enum class Integrator { euler_substeps, closed_form, continuous };
+
+const char* const integrator_names[] = {
+    "Euler substeps", "closed form", "continuous wall collisions"
+};
+
+// The box the balls bounce in and the gravity; bouncy.cc replaces them
+// from the command line and scene files. Only changed while no physics
+// is running.
+float min_x = -0.8f, max_x = +0.8f;
+float min_y = 0.0f, max_y = 2.0f;
+float min_z = -0.8f, max_z = +0.8f;
+float gravity = 0.0f; // See --gravity.
+int ticks_per_frame = 20; // Euler substeps per step; see --ticks-per-frame.
+
+// Minimal SIMD float types for the physics kernels: Floats holds
+// Floats::width lanes (8 with AVX, 4 with SSE2 or NEON) and
+// ScalarFloats is the one-lane fallback with the same interface, used
+// for leftover balls and when there is no SIMD support (or
+// BOUNCY_NO_SIMD is defined). Comparisons give a Mask, and select()
+// blends by mask, so kernels written against this interface have no
+// per-ball branches.
+struct ScalarFloats {
+    static constexpr int width = 1;
+    using Mask = bool;
+    float v;
+    
+    static ScalarFloats load(float const* p) { return { *p }; }
+    static ScalarFloats splat(float f) { return { f }; }
+    void store(float* p) const { *p = v; }
+    
+    friend ScalarFloats operator+(ScalarFloats a, ScalarFloats b) { return { a.v + b.v }; }
+    friend ScalarFloats operator-(ScalarFloats a, ScalarFloats b) { return { a.v - b.v }; }
+    friend ScalarFloats operator*(ScalarFloats a, ScalarFloats b) { return { a.v * b.v }; }
+    friend Mask operator>(ScalarFloats a, ScalarFloats b) { return a.v > b.v; }
+    friend Mask operator<(ScalarFloats a, ScalarFloats b) { return a.v < b.v; }
+    friend ScalarFloats select(Mask m, ScalarFloats a, ScalarFloats b) {
+        return m ? a : b;
+    }
+};
+
+#if defined(__AVX__) && !defined(BOUNCY_NO_SIMD)
+struct Floats {
+    static constexpr int width = 8;
+    struct Mask {
+        __m256 m;
+        friend Mask operator&(Mask a, Mask b) { return { _mm256_and_ps(a.m, b.m) }; }
+    };
+    __m256 v;
+    
+    static Floats load(float const* p) { return { _mm256_loadu_ps(p) }; }
+    static Floats splat(float f) { return { _mm256_set1_ps(f) }; }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+    
+    friend Floats operator+(Floats a, Floats b) { return { _mm256_add_ps(a.v, b.v) }; }
+    friend Floats operator-(Floats a, Floats b) { return { _mm256_sub_ps(a.v, b.v) }; }
+    friend Floats operator*(Floats a, Floats b) { return { _mm256_mul_ps(a.v, b.v) }; }
+    friend Mask operator>(Floats a, Floats b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+    friend Mask operator<(Floats a, Floats b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+    friend Floats select(Mask m, Floats a, Floats b) {
+        return { _mm256_blendv_ps(b.v, a.v, m.m) };
+    }
+};
+#elif defined(__SSE2__) && !defined(BOUNCY_NO_SIMD)
+struct Floats {
+    static constexpr int width = 4;
+    struct Mask {
+        __m128 m;
+        friend Mask operator&(Mask a, Mask b) { return { _mm_and_ps(a.m, b.m) }; }
+    };
+    __m128 v;
+    
+    static Floats load(float const* p) { return { _mm_loadu_ps(p) }; }
+    static Floats splat(float f) { return { _mm_set1_ps(f) }; }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+    
+    friend Floats operator+(Floats a, Floats b) { return { _mm_add_ps(a.v, b.v) }; }
+    friend Floats operator-(Floats a, Floats b) { return { _mm_sub_ps(a.v, b.v) }; }
+    friend Floats operator*(Floats a, Floats b) { return { _mm_mul_ps(a.v, b.v) }; }
+    friend Mask operator>(Floats a, Floats b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+    friend Mask operator<(Floats a, Floats b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+    friend Floats select(Mask m, Floats a, Floats b) {
+        // No blendv before SSE4.1.
+        return { _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v)) };
+    }
+};
+#elif defined(__ARM_NEON) && !defined(BOUNCY_NO_SIMD)
+struct Floats {
+    static constexpr int width = 4;
+    struct Mask {
+        uint32x4_t m;
+        friend Mask operator&(Mask a, Mask b) { return { vandq_u32(a.m, b.m) }; }
+    };
+    float32x4_t v;
+    
+    static Floats load(float const* p) { return { vld1q_f32(p) }; }
+    static Floats splat(float f) { return { vdupq_n_f32(f) }; }
+    void store(float* p) const { vst1q_f32(p, v); }
+    
+    friend Floats operator+(Floats a, Floats b) { return { vaddq_f32(a.v, b.v) }; }
+    friend Floats operator-(Floats a, Floats b) { return { vsubq_f32(a.v, b.v) }; }
+    friend Floats operator*(Floats a, Floats b) { return { vmulq_f32(a.v, b.v) }; }
+    friend Mask operator>(Floats a, Floats b) { return { vcgtq_f32(a.v, b.v) }; }
+    friend Mask operator<(Floats a, Floats b) { return { vcltq_f32(a.v, b.v) }; }
+    friend Floats select(Mask m, Floats a, Floats b) {
+        return { vbslq_f32(m.m, a.v, b.v) };
+    }
+};
+#else
+using Floats = ScalarFloats;
+#endif
+
+// Small work-stealing thread pool for the physics. parallel_for splits
+// [0, n) into chunks of grain items; each thread starts with its own
+// contiguous run of chunks and steals chunks from the back of other
+// threads' queues once its own queue is empty. The calling thread
+// works too, so a pool with thread_count threads has thread_count - 1
+// worker threads.
+//
+// Jobs must not depend on which thread runs which chunk; the physics
+// code only writes per-ball or per-chunk results from jobs so that
+// the results don't depend on the number of threads.
+class JobPool {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> chunks;
+    };
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Queue>> queues; // [0] is the caller's.
+    
+    std::mutex mutex;
+    std::condition_variable wake_condition, done_condition;
+    uint64_t generation = 0;
+    int busy_workers = 0;
+    bool quit = false;
+    
+    std::function<void(int, int)> const* job = nullptr;
+    int job_n = 0;
+    int job_grain = 1;
+    
+    // Take a chunk from our own queue, or steal one from another.
+    bool pop_chunk(int self, int* chunk) {
+        int queue_count = int(queues.size());
+        for (int k = 0; k < queue_count; ++k) {
+            Queue& queue = *queues[(self + k) % queue_count];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.chunks.empty()) continue;
+            if (k == 0) {
+                *chunk = queue.chunks.front();
+                queue.chunks.pop_front();
+            } else {
+                *chunk = queue.chunks.back();
+                queue.chunks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+    
+    void run_chunks(int self) {
+        int chunk;
+        while (pop_chunk(self, &chunk)) {
+            int begin = chunk * job_grain;
+            (*job)(begin, std::min(job_n, begin + job_grain));
+        }
+    }
+    
+    void worker_loop(int self) {
+        uint64_t seen_generation = 0;
+        while (1) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake_condition.wait(lock, [&] {
+                    return quit || generation != seen_generation;
+                });
+                if (quit) return;
+                seen_generation = generation;
+            }
+            run_chunks(self);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy_workers == 0) done_condition.notify_all();
+        }
+    }
+    
+  public:
+    explicit JobPool(int thread_count) {
+        thread_count = std::max(1, thread_count);
+        for (int i = 0; i < thread_count; ++i) {
+            queues.emplace_back(new Queue);
+        }
+        for (int i = 1; i < thread_count; ++i) {
+            workers.emplace_back([this, i] { worker_loop(i); });
+        }
+    }
+    
+    ~JobPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake_condition.notify_all();
+        for (std::thread& worker : workers) worker.join();
+    }
+    
+    JobPool(JobPool const&) = delete;
+    
+    int thread_count() const {
+        return int(queues.size());
+    }
+    
+    // Call fn(begin, end) for chunks [begin, end) of at most grain items
+    // covering [0, n), in parallel, and return once all calls are done.
+    // Chunk boundaries are always multiples of grain.
+    void parallel_for(int n, int grain, std::function<void(int, int)> const& fn) {
+        if (workers.empty() || n <= grain) {
+            if (n > 0) fn(0, n);
+            return;
+        }
+        
+        int chunk_count = (n + grain - 1) / grain;
+        int queue_count = int(queues.size());
+        for (int q = 0; q < queue_count; ++q) {
+            int first = chunk_count * q / queue_count;
+            int last = chunk_count * (q + 1) / queue_count;
+            for (int c = first; c < last; ++c) queues[q]->chunks.push_back(c);
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            job_n = n;
+            job_grain = grain;
+            busy_workers = int(workers.size());
+            ++generation;
+        }
+        wake_condition.notify_all();
+        
+        run_chunks(0);
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        done_condition.wait(lock, [&] { return busy_workers == 0; });
+        job = nullptr;
+    }
+};
+
+// Uniform grid broad phase for ball-ball collisions. Balls are binned
+// into cubic cells one ball diameter (of the biggest ball) wide
+// covering the min_x..max_z box; balls outside the box are put in the
+// nearest edge cell. Two balls can only overlap if they're in the
+// same or neighboring cells, so only those pairs need to be handed to
+// BallPhysics::bounce_ball.
+class UniformGrid {
+    float cell_size = 1.0f;
+    int dim[3] = { 1, 1, 1 };
+    std::vector<int> ball_cell;   // Cell index of each ball.
+    std::vector<int> cell_start;  // cell_balls[cell_start[c]...] are in cell c.
+    std::vector<int> cell_balls;  // Ball indices sorted by cell.
+    
+    int clamped_cell_coord(float coord, float min, int axis) const {
+        float c = floorf((coord - min) / cell_size);
+        return c < 0 ? 0 : c >= dim[axis] ? dim[axis] - 1 : int(c);
+    }
+  public:
+    // Bin the balls at the given positions (counting sort by cell).
+    void build(
+        int ball_count, float const* x, float const* y, float const* z,
+        float max_radius
+    ) {
+        // Cells must be at least a ball across; past that, keep at most
+        // about eight cells per ball so that big boxes of small balls
+        // don't need huge grids. (Eight measured fastest in
+        // physics_bench: fewer cells test many more pairs, more cells
+        // mostly scan empty ones.)
+        float volume = (max_x - min_x) * (max_y - min_y) * (max_z - min_z);
+        cell_size = std::max(2.0f * max_radius,
+                             cbrtf(volume / std::max(1, 8 * ball_count)));
+        dim[0] = std::max(1, int(ceilf((max_x - min_x) / cell_size)));
+        dim[1] = std::max(1, int(ceilf((max_y - min_y) / cell_size)));
+        dim[2] = std::max(1, int(ceilf((max_z - min_z) / cell_size)));
+        int cell_count = dim[0] * dim[1] * dim[2];
+        
+        ball_cell.resize(ball_count);
+        cell_start.assign(cell_count + 1, 0);
+        cell_balls.resize(ball_count);
+        
+        for (int i = 0; i < ball_count; ++i) {
+            int cx = clamped_cell_coord(x[i], min_x, 0);
+            int cy = clamped_cell_coord(y[i], min_y, 1);
+            int cz = clamped_cell_coord(z[i], min_z, 2);
+            int cell = (cz * dim[1] + cy) * dim[0] + cx;
+            ball_cell[i] = cell;
+            ++cell_start[cell + 1];
+        }
+        for (int c = 0; c < cell_count; ++c) {
+            cell_start[c + 1] += cell_start[c];
+        }
+        std::vector<int> fill(cell_start.begin(), cell_start.end() - 1);
+        for (int i = 0; i < ball_count; ++i) {
+            cell_balls[fill[ball_cell[i]]++] = i;
+        }
+    }
+    
+    // Replace the contents of *pairs with every candidate pair (i, j)
+    // with i < j, sorted by i then j. That's the order in which the
+    // all-pairs loop used to visit them, so resolving collisions in
+    // this order gives the same results.
+    void find_pairs(std::vector<std::pair<int, int>>* pairs) const {
+        find_pairs(0, int(ball_cell.size()), pairs);
+    }
+    
+    // Same, but only the pairs with begin <= i < end. Safe to call from
+    // several threads at once.
+    void find_pairs(
+        int begin, int end, std::vector<std::pair<int, int>>* pairs
+    ) const {
+        pairs->clear();
+        std::vector<int> others;
+        
+        for (int i = begin; i < end; ++i) {
+            int cell = ball_cell[i];
+            int cx = cell % dim[0];
+            int cy = (cell / dim[0]) % dim[1];
+            int cz = cell / (dim[0] * dim[1]);
+            others.clear();
+            
+            for (int z = std::max(0, cz-1); z <= std::min(dim[2]-1, cz+1); ++z) {
+                for (int y = std::max(0, cy-1); y <= std::min(dim[1]-1, cy+1); ++y) {
+                    for (int x = std::max(0, cx-1); x <= std::min(dim[0]-1, cx+1); ++x) {
+                        int c = (z * dim[1] + y) * dim[0] + x;
+                        for (int k = cell_start[c]; k < cell_start[c+1]; ++k) {
+                            if (cell_balls[k] > i) others.push_back(cell_balls[k]);
+                        }
+                    }
+                }
+            }
+            std::sort(others.begin(), others.end());
+            for (int j : others) pairs->emplace_back(i, j);
+        }
+    }
+    
+    // Call visit(i) for the balls in the cells that the sphere at center
+    // overlaps, which include every ball within radius of center, until
+    // visit returns true. Returns whether it did.
+    template <typename Visit>
+    bool visit_near(glm::vec3 center, float radius, Visit const& visit) const {
+        int x0 = clamped_cell_coord(center.x - radius, min_x, 0);
+        int x1 = clamped_cell_coord(center.x + radius, min_x, 0);
+        int y0 = clamped_cell_coord(center.y - radius, min_y, 1);
+        int y1 = clamped_cell_coord(center.y + radius, min_y, 1);
+        int z0 = clamped_cell_coord(center.z - radius, min_z, 2);
+        int z1 = clamped_cell_coord(center.z + radius, min_z, 2);
+        for (int z = z0; z <= z1; ++z) {
+            for (int y = y0; y <= y1; ++y) {
+                for (int x = x0; x <= x1; ++x) {
+                    int c = (z * dim[1] + y) * dim[0] + x;
+                    for (int k = cell_start[c]; k < cell_start[c+1]; ++k) {
+                        if (visit(cell_balls[k])) return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+};
+
+// Unsophisticated bouncy physics for all the balls. The state is
+// stored as a structure of arrays (ball i is x[i], vx[i], ...) so the
+// per-ball loops run over contiguous floats that the compiler can
+// vectorize.
+class BallPhysics {
+  public:
+    std::vector<float> x, y, z;
+    std::vector<float> vx, vy, vz;
+    std::vector<float> radius;
+    std::vector<uint8_t> bounced;
+    
+    // If set, step() splits its work over the threads of this pool.
+    // The results are the same for any number of threads.
+    JobPool* jobs = nullptr;
+    
+    int size() const {
+        return int(x.size());
+    }
+    
+    void add(glm::vec3 position, glm::vec3 velocity, float radius_arg) {
+        x.push_back(position[0]);
+        y.push_back(position[1]);
+        z.push_back(position[2]);
+        vx.push_back(velocity[0]);
+        vy.push_back(velocity[1]);
+        vz.push_back(velocity[2]);
+        radius.push_back(radius_arg);
+        bounced.push_back(false);
+    }
+    
+    void clear() {
+        for (auto* v : { &x, &y, &z, &vx, &vy, &vz, &radius }) v->clear();
+        bounced.clear();
+    }
+    
+    glm::vec3 position(int i) const {
+        return glm::vec3(x[i], y[i], z[i]);
+    }
+    
+    float max_radius() const {
+        float result = 0.0f;
+        for (float r : radius) result = std::max(result, r);
+        return result;
+    }
+    
+    // Returns true (and modifies velocity) if ball i bounces with ball
+    // j. Ball j is also affected. We bounce if the two balls overlap
+    // and the two balls are moving towards each other (so don't bounce
+    // if they're already moving away; that would put them back on a
+    // collision course).
+    //
+    // Sets the bounce flag of both balls to true if we bounced.
+    bool bounce_ball(int i, int j) {
+        if (would_bounce(i, j)) {
+            swap(vx[i], vx[j]);
+            swap(vy[i], vy[j]);
+            swap(vz[i], vz[j]);
+            bounced[i] = true;
+            bounced[j] = true;
+            return true;
+        } else {
+            return false;
+        }
+    }
+    
+    // The bounce test of bounce_ball, without changing anything.
+    bool would_bounce(int i, int j) const {
+        // This isn't right physics.
+        float dx = x[j] - x[i], dy = y[j] - y[i], dz = z[j] - z[i];
+        float squared_distance = dx*dx + dy*dy + dz*dz;
+        float squared_radii = (radius[i] + radius[j])
+                            * (radius[i] + radius[j]);
+        
+        bool collision_course = dx * (vx[i] - vx[j])
+                              + dy * (vy[i] - vy[j])
+                              + dz * (vz[i] - vz[j]) > 0;
+        
+        return collision_course && squared_distance < squared_radii;
+    }
+    
+    // Resolve ball-ball collisions for the candidate pairs (in order),
+    // skipping balls that already bounced.
+    void bounce_balls(std::vector<std::pair<int, int>> const& pairs) {
+        for (auto const& pair : pairs) {
+            if (!bounced[pair.first] && !bounced[pair.second]) {
+                bounce_ball(pair.first, pair.second);
+            }
+        }
+    }
+    
+    // For every ball, reverse the velocity along each axis where the
+    // ball is beyond the edge of the bounding box (min/max x y z) and
+    // moving further out, and put it back on the edge.
+    //
+    // Sets the bounce flag of the balls that bounced.
+    void bounce_bounds() {
+        auto bounce_axis = [](float* p, float* v, float r, float lo, float hi) {
+            if (*p + r > hi && *v > 0) {
+                *v *= -1.0f;
+                *p = hi - r;
+                return true;
+            }
+            if (*p - r < lo && *v < 0) {
+                *v *= -1.0f;
+                *p = lo + r;
+                return true;
+            }
+            return false;
+        };
+        
+        for (int i = 0; i < size(); ++i) {
+            bool flag = false;
+            flag |= bounce_axis(&x[i], &vx[i], radius[i], min_x, max_x);
+            flag |= bounce_axis(&y[i], &vy[i], radius[i], min_y, max_y);
+            flag |= bounce_axis(&z[i], &vz[i], radius[i], min_z, max_z);
+            bounced[i] |= flag;
+        }
+    }
+    
+    void reset_bounce_flags() {
+        std::fill(bounced.begin(), bounced.end(), 0);
+    }
+    
+    // Euler method ticks: update positions using velocity and velocity
+    // using gravity acceleration, steps times.
+    void tick(float dt, int steps) {
+        int n = size();
+        float* px = x.data();
+        float* py = y.data();
+        float* pz = z.data();
+        float* pvx = vx.data();
+        float* pvy = vy.data();
+        float* pvz = vz.data();
+        for (int s = 0; s < steps; ++s) {
+            for (int i = 0; i < n; ++i) {
+                pvy[i] -= dt * gravity;
+                px[i] += pvx[i] * dt;
+                py[i] += pvy[i] * dt;
+                pz[i] += pvz[i] * dt;
+            }
+        }
+    }
+    
+    // Same result as bounce_bounds(); tick(dt, steps);
+    // reset_bounce_flags(); but done with SIMD, Floats::width balls at
+    // a time, keeping each ball in registers for all the ticks. The
+    // wall bounces use masked blends instead of branches.
+    void bounce_bounds_and_tick(float dt, int steps) {
+        kernel_range<false>(0, size(), dt, steps);
+        reset_bounce_flags();
+    }
+    
+    // Like bounce_bounds_and_tick, but instead of Euler ticks, move
+    // each ball along its exact trajectory (constant gravity) for time
+    // dt in one step.
+    void bounce_bounds_and_advance(float dt) {
+        kernel_range<true>(0, size(), dt, 1);
+        reset_bounce_flags();
+    }
+    
+    // Move each ball along its exact trajectory for time dt, bouncing
+    // it off the walls at the exact times it hits them (continuous
+    // collision detection). The box is axis-aligned and gravity only
+    // acts along y, so each axis can be solved on its own. Clears the
+    // bounce flags.
+    void advance_continuous(float dt) {
+        continuous_range(0, size(), dt);
+        reset_bounce_flags();
+    }
+    
+    // Advance the simulation by one frame of length frame_dt: move the
+    // balls (bouncing off the walls) as chosen by integrator, then
+    // resolve ball-ball collisions found by the broad phase.
+    //
+    // With a JobPool, moving the balls and finding the pairs of balls
+    // that would bounce are split over threads by ranges of balls.
+    // Whether a pair would bounce depends only on the two balls'
+    // positions and velocities, and bouncing sets the bounce flags
+    // that stop either ball from bouncing again, so testing all pairs
+    // up front and then resolving the hits in (i, j) order on one
+    // thread gives exactly the single threaded result.
+    void step(float frame_dt, Integrator integrator=Integrator::euler_substeps) {
+        for_chunks(size(), move_grain, [&](int begin, int end) {
+            switch (integrator) {
+              case Integrator::euler_substeps:
+                kernel_range<false>(begin, end,
+                                    frame_dt / ticks_per_frame, ticks_per_frame);
+              break; case Integrator::closed_form:
+                kernel_range<true>(begin, end, frame_dt, 1);
+              break; case Integrator::continuous:
+                continuous_range(begin, end, frame_dt);
+            }
+        });
+        reset_bounce_flags();
+        
+        grid.build(size(), x.data(), y.data(), z.data(), max_radius());
+        
+        int chunk_count = (size() + pair_grain - 1) / pair_grain;
+        if (int(chunk_hits.size()) < chunk_count) chunk_hits.resize(chunk_count);
+        for (auto& hits : chunk_hits) hits.clear();
+        
+        for_chunks(size(), pair_grain, [&](int begin, int end) {
+            auto& hits = chunk_hits[begin / pair_grain];
+            grid.find_pairs(begin, end, &hits);
+            auto misses = std::remove_if(hits.begin(), hits.end(),
+                [this] (std::pair<int, int> pair) {
+                    return !would_bounce(pair.first, pair.second);
+                });
+            hits.erase(misses, hits.end());
+        });
+        
+        for (auto const& hits : chunk_hits) bounce_balls(hits);
+    }
+    
+  private:
+    // Balls per job chunk; move_grain must be a multiple of Floats::width.
+    static constexpr int move_grain = 64 * Floats::width, pair_grain = 256;
+    
+    UniformGrid grid;
+    std::vector<std::vector<std::pair<int, int>>> chunk_hits;
+    
+    void for_chunks(int n, int grain, std::function<void(int, int)> const& fn) {
+        if (jobs) {
+            jobs->parallel_for(n, grain, fn);
+        } else if (n > 0) {
+            fn(0, n);
+        }
+    }
+    
+    template <bool ClosedForm>
+    void kernel_range(int begin, int end, float dt, int steps) {
+        int i = begin;
+        for (; i + Floats::width <= end; i += Floats::width) {
+            bounce_bounds_and_tick_kernel<Floats, ClosedForm>(i, dt, steps);
+        }
+        for (; i < end; ++i) {
+            bounce_bounds_and_tick_kernel<ScalarFloats, ClosedForm>(i, dt, steps);
+        }
+    }
+    
+    void continuous_range(int begin, int end, float dt) {
+        for (int i = begin; i < end; ++i) {
+            advance_axis(&x[i], &vx[i], radius[i], min_x, max_x, 0.0f, dt);
+            advance_axis(&y[i], &vy[i], radius[i], min_y, max_y, -gravity, dt);
+            advance_axis(&z[i], &vz[i], radius[i], min_z, max_z, 0.0f, dt);
+        }
+    }
+    
+    // Returns the earliest time in (0, max_t] at which a point at p
+    // moving with velocity v and acceleration a reaches w while moving
+    // in the direction of sign (+1 or -1), or infinity if it doesn't.
+    static float time_of_impact(
+        float p, float v, float a, float w, float sign, float max_t
+    ) {
+        float roots[2];
+        int root_count = 0;
+        if (a == 0.0f) {
+            if (v != 0.0f) roots[root_count++] = (w - p) / v;
+        } else {
+            float discriminant = v*v - 2.0f*a*(p - w);
+            if (discriminant >= 0.0f) {
+                float q = sqrtf(discriminant);
+                float t0 = (-v - q) / a, t1 = (-v + q) / a;
+                roots[root_count++] = std::min(t0, t1);
+                roots[root_count++] = std::max(t0, t1);
+            }
+        }
+        for (int k = 0; k < root_count; ++k) {
+            float t = roots[k];
+            if (t > 0.0f && t <= max_t && sign * (v + a*t) > 0.0f) return t;
+        }
+        return INFINITY;
+    }
+    
+    // Move one coordinate of a ball of radius r for time dt between the
+    // walls at lo and hi, bouncing at the exact time of each impact.
+    static void advance_axis(
+        float* p_ptr, float* v_ptr, float r, float lo, float hi, float a, float dt
+    ) {
+        float p = *p_ptr, v = *v_ptr;
+        
+        // Already beyond a wall and moving out: bounce now, just like
+        // bounce_bounds.
+        if (p + r > hi && v > 0) {
+            v = -v;
+            p = hi - r;
+        }
+        if (p - r < lo && v < 0) {
+            v = -v;
+            p = lo + r;
+        }
+        
+        // Bounce from wall to wall. A ball resting on the floor under
+        // gravity would bounce infinitely often, so give up after
+        // max_bounces and just keep the ball inside the box.
+        const int max_bounces = 64;
+        int bounce = 0;
+        for (; bounce < max_bounces; ++bounce) {
+            float t_hi = time_of_impact(p, v, a, hi - r, +1.0f, dt);
+            float t_lo = time_of_impact(p, v, a, lo + r, -1.0f, dt);
+            float t = std::min(t_hi, t_lo);
+            if (t == INFINITY) break;
+            
+            v = -(v + a*t);
+            p = t_hi < t_lo ? hi - r : lo + r;
+            dt -= t;
+        }
+        
+        p += v*dt + 0.5f*a*dt*dt;
+        v += a*dt;
+        if (bounce == max_bounces) {
+            p = std::min(hi - r, std::max(lo + r, p));
+        }
+        *p_ptr = p;
+        *v_ptr = v;
+    }
+    
+    // Bounce and tick balls i to i + F::width - 1; if ClosedForm,
+    // move them along the exact trajectory for time dt * steps instead
+    // of ticking.
+    template <typename F, bool ClosedForm>
+    void bounce_bounds_and_tick_kernel(int i, float dt, int steps) {
+        F p[3] = { F::load(&x[i]), F::load(&y[i]), F::load(&z[i]) };
+        F v[3] = { F::load(&vx[i]), F::load(&vy[i]), F::load(&vz[i]) };
+        const F r = F::load(&radius[i]);
+        const F zero = F::splat(0.0f);
+        const float lo[3] = { min_x, min_y, min_z };
+        const float hi[3] = { max_x, max_y, max_z };
+        
+        // Same tests, in the same order, as bounce_bounds.
+        for (int axis = 0; axis < 3; ++axis) {
+            F& pa = p[axis];
+            F& va = v[axis];
+            F edge = F::splat(hi[axis]) - r;
+            auto out = (pa + r > F::splat(hi[axis])) & (va > zero);
+            pa = select(out, edge, pa);
+            va = select(out, zero - va, va);
+            
+            edge = F::splat(lo[axis]) + r;
+            out = (pa - r < F::splat(lo[axis])) & (va < zero);
+            pa = select(out, edge, pa);
+            va = select(out, zero - va, va);
+        }
+        
+        if (ClosedForm) {
+            const float t = dt * steps;
+            const F t_vec = F::splat(t);
+            p[0] = p[0] + v[0] * t_vec;
+            p[1] = p[1] + v[1] * t_vec - F::splat(0.5f * gravity * t * t);
+            p[2] = p[2] + v[2] * t_vec;
+            v[1] = v[1] - F::splat(gravity * t);
+        } else {
+            const F dt_vec = F::splat(dt);
+            const F dv = F::splat(dt * gravity);
+            for (int s = 0; s < steps; ++s) {
+                v[1] = v[1] - dv;
+                p[0] = p[0] + v[0] * dt_vec;
+                p[1] = p[1] + v[1] * dt_vec;
+                p[2] = p[2] + v[2] * dt_vec;
+            }
+        }
+        
+        p[0].store(&x[i]);
+        p[1].store(&y[i]);
+        p[2].store(&z[i]);
+        v[0].store(&vx[i]);
+        v[1].store(&vy[i]);
+        v[2].store(&vz[i]);
+    }
+};
+
+} // end anonymous namespace
+
+#endif // BOUNCY_PHYSICS_HH
@@ -0,0 +1,280 @@
+// Microbenchmarks for the ball physics in physics.hh, without OpenGL.
+//
+// For every combination of ball count and density (the fraction of
+// the box the balls fill), this spawns random balls in a cube just big
+// enough for that density, then times each physics kernel on its own
+// copy of them: the Euler tick, the wall bounce, the SIMD bounce and
+// tick kernels of each integrator, the all-pairs collision loop the
+// uniform grid replaced, the grid broad phase, and whole steps on one
+// thread and on a JobPool. Each kernel runs until it has taken at
+// least --min-ms.
+//
+// Times are reported as nanoseconds per ball per tick, where a tick is
+// one Euler substep for the kernels that take ticks_per_frame of them
+// and one call for the others. The collision kernels also report how
+// many pairs of balls they tested per call.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+
+#include "physics.hh"
+
+namespace {
+
+constexpr float frame_dt = 0.005f; // Bouncy's default tick_dt.
+
+std::vector<int> ball_counts = { 10, 100, 1000, 10000, 100000 };
+std::vector<float> densities = { 0.001f, 0.01f, 0.1f };
+float ball_radius = 0.1f;
+double min_ms = 200.0;
+int thread_count = int(std::thread::hardware_concurrency());
+int all_pairs_max_balls = 10000;
+unsigned int random_seed = 1;
+std::string csv_path;
+
+static void panic(const char* message, const char* reason) {
+    fprintf(stderr, "%s %s\n", message, reason);
+    exit(1);
+}
+
+// One thing to time. run moves or bounces the balls once and returns
+// the number of pairs of balls it tested.
+struct Kernel {
+    const char* name;
+    bool euler_ticks; // Whether one run is ticks_per_frame ticks.
+    std::function<int64_t(BallPhysics*)> run;
+};
+
+static std::vector<Kernel> kernels(JobPool* jobs) {
+    return {
+        { "tick", true, [] (BallPhysics* p) {
+            p->tick(frame_dt / ticks_per_frame, ticks_per_frame);
+            return int64_t(0);
+        }},
+        { "bounce_bounds", false, [] (BallPhysics* p) {
+            p->bounce_bounds();
+            p->reset_bounce_flags();
+            return int64_t(0);
+        }},
+        { "bounce_bounds_and_tick", true, [] (BallPhysics* p) {
+            p->bounce_bounds_and_tick(frame_dt / ticks_per_frame, ticks_per_frame);
+            return int64_t(0);
+        }},
+        { "bounce_bounds_and_advance", false, [] (BallPhysics* p) {
+            p->bounce_bounds_and_advance(frame_dt);
+            return int64_t(0);
+        }},
+        { "advance_continuous", false, [] (BallPhysics* p) {
+            p->advance_continuous(frame_dt);
+            return int64_t(0);
+        }},
+        { "all pairs", false, [] (BallPhysics* p) {
+            int n = p->size();
+            for (int i = 0; i < n; ++i) {
+                for (int j = i + 1; j < n; ++j) {
+                    if (!p->bounced[i] && !p->bounced[j]) p->bounce_ball(i, j);
+                }
+            }
+            p->reset_bounce_flags();
+            return int64_t(n) * (n - 1) / 2;
+        }},
+        { "grid pairs", false, [] (BallPhysics* p) {
+            static UniformGrid grid;
+            static std::vector<std::pair<int, int>> pairs;
+            grid.build(p->size(), p->x.data(), p->y.data(), p->z.data(),
+                       p->max_radius());
+            grid.find_pairs(&pairs);
+            p->bounce_balls(pairs);
+            p->reset_bounce_flags();
+            return int64_t(pairs.size());
+        }},
+        { "step", false, [] (BallPhysics* p) {
+            p->jobs = nullptr;
+            p->step(frame_dt, Integrator::euler_substeps);
+            return int64_t(0);
+        }},
+        { "step (JobPool)", false, [jobs] (BallPhysics* p) {
+            p->jobs = jobs;
+            p->step(frame_dt, Integrator::euler_substeps);
+            return int64_t(0);
+        }},
+    };
+}
+
+// Random balls filling density of a cube at the origin, which becomes
+// the physics box.
+static BallPhysics spawn(int count, float density) {
+    float ball_volume = 4.18879f * ball_radius * ball_radius * ball_radius;
+    float side = cbrtf(count * ball_volume / density);
+    min_x = min_y = min_z = 0.0f;
+    max_x = max_y = max_z = side;
+    
+    srandom(random_seed);
+    auto rnd = [](float min, float max) {
+        return uint16_t(random()) * ((max-min)/65535.f) + min;
+    };
+    BallPhysics physics;
+    for (int i = 0; i < count; ++i) {
+        glm::vec3 position(rnd(ball_radius, side - ball_radius),
+                           rnd(ball_radius, side - ball_radius),
+                           rnd(ball_radius, side - ball_radius));
+        physics.add(position, glm::vec3(rnd(-3, 3), rnd(1, 4.5), rnd(-3, 3)),
+                    ball_radius);
+    }
+    return physics;
+}
+
+static std::vector<std::string> split_list(const char* value) {
+    std::vector<std::string> items;
+    std::string item;
+    for (const char* c = value; ; ++c) {
+        if (*c == ',' || *c == '\0') {
+            if (!item.empty()) items.push_back(item);
+            item.clear();
+            if (*c == '\0') return items;
+        } else {
+            item += *c;
+        }
+    }
+}
+
+// Command line options, which --help prints.
+static const char usage[] =
+    "Options:\n"
+    "    --counts N,N,...       ball counts (default 10,100,1000,10000,100000)\n"
+    "    --densities D,D,...    fractions of the box filled by balls\n"
+    "                           (default 0.001,0.01,0.1)\n"
+    "    --radius R             ball radius (default 0.1)\n"
+    "    --gravity G            downward acceleration (default 0)\n"
+    "    --ticks-per-frame N    Euler substeps per step (default 20)\n"
+    "    --min-ms N             time each kernel for at least N ms (default 200)\n"
+    "    --threads N            JobPool threads (default: one per core)\n"
+    "    --all-pairs-max N      skip the all-pairs loop above N balls\n"
+    "                           (default 10000)\n"
+    "    --seed N               seed for the random balls (default 1)\n"
+    "    --csv F                also write the results to F as CSV\n";
+
+static void parse_args(int argc, char** argv) {
+    static const char* const options[] = {
+        "--counts", "--densities", "--radius", "--gravity",
+        "--ticks-per-frame", "--min-ms", "--threads", "--all-pairs-max",
+        "--seed", "--csv",
+    };
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            printf("Usage: %s [options]\n%s", argv[0], usage);
+            exit(0);
+        }
+        bool known = false;
+        for (const char* option : options) known = known || arg == option;
+        if (!known) {
+            fprintf(stderr, "Unknown option %s\n%s", argv[i], usage);
+            exit(1);
+        }
+        if (i + 1 == argc) panic("Missing value for option", argv[i]);
+        const char* value = argv[++i];
+        
+        if (arg == "--counts") {
+            ball_counts.clear();
+            for (std::string const& item : split_list(value)) {
+                ball_counts.push_back(atoi(item.c_str()));
+                if (ball_counts.back() < 1) panic("Invalid --counts", value);
+            }
+            if (ball_counts.empty()) panic("Invalid --counts", value);
+        } else if (arg == "--densities") {
+            densities.clear();
+            for (std::string const& item : split_list(value)) {
+                densities.push_back(float(atof(item.c_str())));
+                if (!(densities.back() > 0 && densities.back() < 0.5f)) {
+                    panic("Invalid --densities", value);
+                }
+            }
+            if (densities.empty()) panic("Invalid --densities", value);
+        } else if (arg == "--radius") {
+            ball_radius = float(atof(value));
+            if (!(ball_radius > 0)) panic("Invalid --radius", value);
+        } else if (arg == "--gravity") {
+            gravity = float(atof(value));
+        } else if (arg == "--ticks-per-frame") {
+            ticks_per_frame = atoi(value);
+            if (ticks_per_frame < 1) panic("Invalid --ticks-per-frame", value);
+        } else if (arg == "--min-ms") {
+            min_ms = atof(value);
+            if (!(min_ms > 0)) panic("Invalid --min-ms", value);
+        } else if (arg == "--threads") {
+            thread_count = atoi(value);
+            if (thread_count < 1) panic("Invalid --threads", value);
+        } else if (arg == "--all-pairs-max") {
+            all_pairs_max_balls = atoi(value);
+        } else if (arg == "--seed") {
+            random_seed = unsigned(atoll(value));
+        } else if (arg == "--csv") {
+            csv_path = value;
+        }
+    }
+}
+
+int Main(int argc, char** argv) {
+    typedef std::chrono::steady_clock clock;
+    parse_args(argc, argv);
+    
+    FILE* csv = nullptr;
+    if (!csv_path.empty()) {
+        csv = fopen(csv_path.c_str(), "w");
+        if (csv == nullptr) panic("Could not open", csv_path.c_str());
+        fprintf(csv, "balls,density,kernel,runs,ns_per_ball_tick,pairs_per_run\n");
+    }
+    
+    JobPool jobs(std::max(1, thread_count));
+    std::vector<Kernel> all_kernels = kernels(&jobs);
+    printf("%d-wide SIMD, %d ticks per frame, %d JobPool threads\n",
+           Floats::width, ticks_per_frame, thread_count);
+    printf("%7s %8s %-26s %8s %13s %14s\n", "balls", "density", "kernel",
+           "runs", "ns/ball/tick", "pairs/run");
+    
+    for (int count : ball_counts) {
+        for (float density : densities) {
+            BallPhysics initial = spawn(count, density);
+            for (Kernel const& kernel : all_kernels) {
+                bool all_pairs = strcmp(kernel.name, "all pairs") == 0;
+                if (all_pairs && count > all_pairs_max_balls) continue;
+                
+                BallPhysics physics = initial;
+                int64_t runs = 0, pairs = 0;
+                double elapsed_ms = 0.0;
+                auto start = clock::now();
+                while (elapsed_ms < min_ms) {
+                    pairs += kernel.run(&physics);
+                    ++runs;
+                    elapsed_ms = std::chrono::duration<double, std::milli>(
+                        clock::now() - start).count();
+                }
+                
+                int ticks = kernel.euler_ticks ? ticks_per_frame : 1;
+                double ns = elapsed_ms * 1e6 / (double(runs) * count * ticks);
+                double pairs_per_run = double(pairs) / runs;
+                printf("%7d %8g %-26s %8lld %13.3f %14.0f\n", count, density,
+                       kernel.name, (long long)runs, ns, pairs_per_run);
+                fflush(stdout);
+                if (csv) {
+                    fprintf(csv, "%d,%g,%s,%lld,%.4f,%.1f\n", count, density,
+                            kernel.name, (long long)runs, ns, pairs_per_run);
+                }
+            }
+        }
+    }
+    
+    if (csv && fclose(csv) != 0) panic("Could not write", csv_path.c_str());
+    return 0;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv) {
+    return Main(argc, argv);
+}